@@ -15,6 +15,13 @@
 
 void Vector(void)
 {	int i;
+
+    // With fast_start, the bootloader jumps here straight from reset, on
+    // the slow clock and with the PIO untouched.
+    PMC_PERIPHERAL_CLK_ENABLE = (1<<PERIPH_PIOA);
+    PIO_ENABLE = (1<<GPIO_LED);
+    PIO_OUTPUT_ENABLE = (1<<GPIO_LED);
+
     // Of course, for real you would jump to your start code here.
     for(;;) {
 		for(i = 0; i < 1000000; i++) LED_ON();
@@ -45,9 +45,56 @@ typedef int BOOL;
 #define RSTC_BASE   (0xfffffd00)
 
 #define RSTC_CONTROL            REG(RSTC_BASE+0x00)
+#define RSTC_STATUS             REG(RSTC_BASE+0x04)
+#define RSTC_MODE               REG(RSTC_BASE+0x08)
 
 #define RST_CONTROL_KEY                 (0xa5<<24)
 #define RST_CONTROL_PROCESSOR_RESET     (1<<0)
+#define RST_CONTROL_PERIPHERAL_RESET    (1<<2)
+
+#define RST_STATUS_TYPE(x)              (((x)>>8)&7)
+#define RST_TYPE_POWER_UP               0
+#define RST_TYPE_WATCHDOG               2
+#define RST_TYPE_SOFTWARE               3
+#define RST_TYPE_USER                   4
+
+
+//-------------
+// Advanced Interrupt Controller
+
+#define AIC_BASE    (0xfffff000)
+
+#define AIC_SOURCE_MODE(x)      REG(AIC_BASE+0x000+((x)*4))
+#define AIC_SOURCE_VECTOR(x)    REG(AIC_BASE+0x080+((x)*4))
+#define AIC_IRQ_VECTOR          REG(AIC_BASE+0x100)
+#define AIC_FIQ_VECTOR          REG(AIC_BASE+0x104)
+#define AIC_INTERRUPT_STATUS    REG(AIC_BASE+0x108)
+#define AIC_INTERRUPT_PENDING   REG(AIC_BASE+0x10c)
+#define AIC_INTERRUPT_MASK      REG(AIC_BASE+0x110)
+#define AIC_INTERRUPT_ENABLE    REG(AIC_BASE+0x120)
+#define AIC_INTERRUPT_DISABLE   REG(AIC_BASE+0x124)
+#define AIC_INTERRUPT_CLEAR     REG(AIC_BASE+0x128)
+#define AIC_END_OF_INTERRUPT    REG(AIC_BASE+0x130)
+#define AIC_SPURIOUS_VECTOR     REG(AIC_BASE+0x134)
+
+#define AIC_SOURCE_MODE_PRIORITY(x)             ((x)<<0)
+#define AIC_SOURCE_MODE_LEVEL_SENSITIVE         (0<<5)
+#define AIC_SOURCE_MODE_EDGE_TRIGGERED          (1<<5)
+
+
+//-------------
+// Periodic Interval Timer
+
+#define PIT_BASE    (0xfffffd30)
+
+#define PIT_MODE                REG(PIT_BASE+0x00)
+#define PIT_STATUS              REG(PIT_BASE+0x04)
+#define PIT_VALUE               REG(PIT_BASE+0x08)
+#define PIT_IMAGE               REG(PIT_BASE+0x0c)
+
+#define PIT_MODE_INTERVAL(x)                    ((x)<<0)
+#define PIT_MODE_ENABLE                         (1<<24)
+#define PIT_MODE_INTERRUPT_ENABLE               (1<<25)
 
 
 //-------------
@@ -87,10 +134,13 @@ typedef int BOOL;
 
 #define MC_BASE (0xffffff00)
 
+#define MC_REMAP            REG(MC_BASE+0x00)
 #define MC_FLASH_MODE       REG(MC_BASE+0x60)
 #define MC_FLASH_COMMAND    REG(MC_BASE+0x64)
 #define MC_FLASH_STATUS     REG(MC_BASE+0x68)
 
+#define MC_REMAP_TOGGLE                                 (1<<0)
+
 #define MC_FLASH_MODE_READY_INTERRUPT_ENABLE            (1<<0)
 #define MC_FLASH_MODE_LOCK_INTERRUPT_ENABLE             (1<<2)
 #define MC_FLASH_MODE_PROG_ERROR_INTERRUPT_ENABLE       (1<<3)
@@ -282,6 +332,11 @@ typedef int BOOL;
 #define PMC_CLK_PRESCALE_DIV_16                 (4<<2)
 #define PMC_CLK_PRESCALE_DIV_32                 (5<<2)
 #define PMC_CLK_PRESCALE_DIV_64                 (6<<2)
+#define PMC_CLK_PRESCALE_MASK                   (7<<2)
+
+#define PMC_STATUS_MAIN_OSCILLATOR_READY        (1<<0)
+#define PMC_STATUS_PLL_LOCKED                   (1<<2)
+#define PMC_STATUS_MASTER_CLK_READY             (1<<3)
 
 
 //-------------
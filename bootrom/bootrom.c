@@ -29,17 +29,27 @@
 #define         AT91C_PMC_PRES_CLK_2                ((unsigned int) 0x1 <<  2) // (PMC) Selected clock divided by 2
 #define         AT91C_PMC_CSS_PLL_CLK              ((unsigned int) 0x3) // (PMC) Clock from PLL is selected
 
+// What ConfigClocks sets up; fromflash.c uses the same.
+#define PLL_SETTING (AT91C_CKGR_USBDIV_1 | (16 << 8) | \
+	(AT91C_CKGR_MUL & (72 << 16)) | (AT91C_CKGR_DIV & 14))
+#define MASTER_CLK_SETTING (AT91C_PMC_PRES_CLK_2 | AT91C_PMC_CSS_PLL_CLK)
+
 static void ConfigClocks(void)
 {
-	PMC_MAIN_OSCILLATOR = ( AT91C_CKGR_OSCOUNT & (0x40 <<8)) | AT91C_CKGR_MOSCEN;
-	// Wait Main Oscillator stabilization
-	while(!(PMC_INTERRUPT_STATUS & AT91C_PMC_MOSCS));
+	// Coming from the first stage, the clocks already run like this; only
+	// after a JTAG load is there anything left to do.
+	if(!(PMC_INTERRUPT_STATUS & AT91C_PMC_MOSCS)) {
+		PMC_MAIN_OSCILLATOR = ( AT91C_CKGR_OSCOUNT & (0x40 <<8)) | AT91C_CKGR_MOSCEN;
+		// Wait Main Oscillator stabilization
+		while(!(PMC_INTERRUPT_STATUS & AT91C_PMC_MOSCS));
+	}
+
+	if(PMC_PLL == PLL_SETTING && PMC_MASTER_CLK == MASTER_CLK_SETTING) {
+		return;
+	}
 
 	// Init PMC Step 2.
-	PMC_PLL = AT91C_CKGR_USBDIV_1           |
-							   (16 << 8)                     |
-							   (AT91C_CKGR_MUL & (72 << 16)) |
-							   (AT91C_CKGR_DIV & 14);
+	PMC_PLL = PLL_SETTING;
 
 	// Wait for PLL stabilization
 	while( !(PMC_INTERRUPT_STATUS & AT91C_PMC_LOCK) );
@@ -62,7 +72,12 @@ static void Fatal(void)
 	for(;;);
 }
 
-static unsigned int crc32(volatile void* memory, unsigned int length)
+//-----------------------------------------------------------------------------
+// The original bit-serial CRC32. crc32() in crc.c does the real work now;
+// this one stays, built as before, so that CMD_CRC32_MEMORY can time the
+// two against each other on the board.
+//-----------------------------------------------------------------------------
+static unsigned int crc32_bitwise(volatile void* memory, unsigned int length)
 {
     unsigned int crc = 0xffffffff;
     unsigned char* data = (unsigned char*)memory;
@@ -82,6 +97,539 @@ static unsigned int crc32(volatile void* memory, unsigned int length)
     return ~crc;
 }
 
+// Flash is at 0x100000, and also at 0 until IrqStart maps RAM there. The
+// host says 0 when it means the start of flash (e.g. for the bootloader's
+// pages and CRC), so addresses below 0x100000 get moved up to the flash.
+#define FLASH_BASE			0x00100000
+#define FLASH_ADDR(a)		((a) < FLASH_BASE ? (a) + FLASH_BASE : (a))
+
+// Pages to be written wait in this ring until the flash controller gets to
+// them, so that the host can send the next pages while we are programming.
+// The page at PageRingHead is the one being received; PageRingCount
+// complete pages wait from PageRingTail on. Pages that came with
+// CMD_WRITE_PAGES get a UsbPageStatus once they are written; pages from
+// CMD_SETUP_WRITE/CMD_FINISH_WRITE were ACKed already.
+#define PAGE_RING_SIZE 4
+
+typedef struct {
+	DWORD		addr;
+	DWORD		seq;
+	BOOL		sendStatus;
+	DWORD		data[FLASH_PAGE_SIZE_BYTES/4];
+} PageBuffer;
+
+static PageBuffer PageRing[PAGE_RING_SIZE];
+static int PageRingHead;
+static int PageRingTail;
+static int PageRingCount;
+
+// TRUE while the flash controller is programming the page at PageRingTail,
+// and the error bits that it reported so far for that page. Reading the
+// status register clears the error bits, so we have to collect them on
+// every read.
+static BOOL FlashBusy;
+static DWORD FlashErrors;
+
+// The state of a CMD_WRITE_PAGES, CMD_WRITE_COMPRESSED or CMD_FILL_PAGES
+// transfer: which one it is, the address and sequence number of the page
+// that is being received, how many bytes of it we have so far, and how many
+// pages (including this one) are still to come.
+#define STREAM_RAW			0
+#define STREAM_LZ			1
+#define STREAM_FILL			2
+
+static int StreamMode;
+static DWORD StreamAddr;
+static DWORD StreamSeq;
+static DWORD StreamOffset;
+static DWORD StreamPages;
+static DWORD StreamFill;
+
+// For CMD_WRITE_COMPRESSED: the last report of compressed data and how far
+// we got with it, the decompressor's window, and its state between items.
+// The flags byte sits in Lz.flags with a 1 above the flags that are still
+// to be used, so that Lz.flags == 1 means that the next byte is a new one.
+static BYTE LzIn[sizeof(UsbCommand)];
+static int LzInPos;
+static int LzInLen;
+static BYTE LzWindow[LZ_WINDOW_SIZE];
+static struct {
+	DWORD		outPos;
+	DWORD		flags;
+	BYTE		first;
+	BOOL		haveFirst;
+	DWORD		matchDist;
+	DWORD		matchLeft;
+} Lz;
+
+// The slot table, as in the boot record; see BootRecordLoad.
+static BootRecord Slots;
+
+// Set when a page that is queued for writing makes a slot forget its
+// validation; FlashPoll then writes the boot record before that page, in
+// the background like any other page, and TRUE in BootRecordBusy while it
+// does. BootRecordPage is the page image of the record.
+static BOOL BootRecordPending;
+static BOOL BootRecordBusy;
+static DWORD BootRecordPage[FLASH_PAGE_SIZE_BYTES/4];
+
+// Entered with BOOT_REQUEST_DOWNLOAD (see BootPolicy).
+static BOOL BootWarm;
+
+// Set by CMD_HARDWARE_RESET: start the application, or reset, once its ACK
+// is out.
+static BOOL StartPending;
+static BOOL ResetPending;
+
+static void FlashFlush(void);
+static void BootSlotForget(DWORD addr);
+static void BootRecordFill(void);
+static BOOL AppStartable(void);
+
+//-----------------------------------------------------------------------------
+// Queue the page at the head of the ring for FlashPoll. The first page of
+// a new application makes the slot table forget the old one; FlashPoll
+// writes that to the boot record before it gets to the page.
+//-----------------------------------------------------------------------------
+static void QueuePage(DWORD addr, DWORD seq, BOOL sendStatus)
+{
+	PageBuffer *pb = &PageRing[PageRingHead];
+
+	BootSlotForget(FLASH_ADDR(addr));
+
+	pb->addr = addr;
+	pb->seq = seq;
+	pb->sendStatus = sendStatus;
+	PageRingHead = (PageRingHead + 1) % PAGE_RING_SIZE;
+	PageRingCount++;
+}
+
+//-----------------------------------------------------------------------------
+// The page at the head of the ring is complete; queue it, and move on to the
+// next one.
+//-----------------------------------------------------------------------------
+static void StreamPageDone(void)
+{
+	QueuePage(StreamAddr, StreamSeq, TRUE);
+
+	StreamAddr += FLASH_PAGE_SIZE_BYTES;
+	StreamSeq++;
+	StreamOffset = 0;
+	StreamPages--;
+}
+
+//-----------------------------------------------------------------------------
+// Take one raw report of page data following a CMD_WRITE_PAGES header into
+// the page at the head of the ring; once we have the whole page, queue it.
+//-----------------------------------------------------------------------------
+static void StreamPacketReceived(BYTE *packet)
+{
+	int i;
+	PageBuffer *pb = &PageRing[PageRingHead];
+	DWORD *d = (DWORD *)packet;
+
+	for(i = 0; i < 16; i++) {
+		pb->data[(StreamOffset/4)+i] = d[i];
+	}
+	StreamOffset += 64;
+
+	if(StreamOffset >= FLASH_PAGE_SIZE_BYTES) {
+		StreamPageDone();
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Put one decompressed byte into the window, and into the page at the head
+// of the ring. The caller has checked that there is room in the ring.
+//-----------------------------------------------------------------------------
+static void LzPut(BYTE b)
+{
+	LzWindow[Lz.outPos & (LZ_WINDOW_SIZE-1)] = b;
+	Lz.outPos++;
+
+	((BYTE *)PageRing[PageRingHead].data)[StreamOffset] = b;
+	StreamOffset++;
+	if(StreamOffset >= FLASH_PAGE_SIZE_BYTES) {
+		StreamPageDone();
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Run the decompressor until it has used up the report in LzIn, or until the
+// ring is full; then it waits, in the middle of a match if need be, until
+// FlashPoll has made room. Returns TRUE if it did something.
+//-----------------------------------------------------------------------------
+static BOOL LzPoll(void)
+{
+	BOOL ret = FALSE;
+	BYTE b;
+
+	while(StreamPages && PageRingCount < PAGE_RING_SIZE) {
+		if(Lz.matchLeft) {
+			LzPut(LzWindow[(Lz.outPos - Lz.matchDist) & (LZ_WINDOW_SIZE-1)]);
+			Lz.matchLeft--;
+			ret = TRUE;
+			continue;
+		}
+
+		if(LzInPos >= LzInLen) {
+			break;
+		}
+		b = LzIn[LzInPos++];
+		ret = TRUE;
+
+		if(Lz.flags == 1) {
+			Lz.flags = b | 0x100;
+		} else if(!(Lz.flags & 1)) {
+			Lz.flags >>= 1;
+			LzPut(b);
+		} else if(!Lz.haveFirst) {
+			Lz.first = b;
+			Lz.haveFirst = TRUE;
+		} else {
+			Lz.flags >>= 1;
+			Lz.haveFirst = FALSE;
+			Lz.matchDist = (Lz.first | ((b & 3) << 8)) + 1;
+			Lz.matchLeft = (b >> 2) + LZ_MIN_MATCH;
+		}
+	}
+
+	if(!StreamPages) {
+		// that was the last page; the rest of the report is padding
+		LzInPos = LzInLen = 0;
+	}
+	return ret;
+}
+
+//-----------------------------------------------------------------------------
+// Take one report of compressed data following a CMD_WRITE_COMPRESSED
+// header. UsbReadyToReceive makes sure that we are done with the last one.
+//-----------------------------------------------------------------------------
+static void LzPacketReceived(BYTE *packet)
+{
+	int i;
+
+	for(i = 0; i < (int)sizeof(LzIn); i++) {
+		LzIn[i] = packet[i];
+	}
+	LzInPos = 0;
+	LzInLen = sizeof(LzIn);
+	LzPoll();
+}
+
+//-----------------------------------------------------------------------------
+// For CMD_FILL_PAGES: make as many pages of the fill pattern as there is
+// room for in the ring. Returns TRUE if it did something.
+//-----------------------------------------------------------------------------
+static BOOL FillPoll(void)
+{
+	int i;
+	BOOL ret = FALSE;
+
+	while(StreamPages && PageRingCount < PAGE_RING_SIZE) {
+		for(i = 0; i < FLASH_PAGE_SIZE_BYTES/4; i++) {
+			PageRing[PageRingHead].data[i] = StreamFill;
+		}
+		StreamPageDone();
+		ret = TRUE;
+	}
+	return ret;
+}
+
+//-----------------------------------------------------------------------------
+// Keep a transfer going that doesn't need more data from the host to make
+// progress. Returns TRUE if it did something.
+//-----------------------------------------------------------------------------
+static BOOL StreamPoll(void)
+{
+	switch(StreamMode) {
+		case STREAM_LZ:
+			return LzPoll();
+
+		case STREAM_FILL:
+			return FillPoll();
+
+		default:
+			return FALSE;
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Returns TRUE if the flash controller is ready for a new command, and
+// collects its error bits in FlashErrors.
+//-----------------------------------------------------------------------------
+static BOOL FlashReady(void)
+{
+	DWORD status = MC_FLASH_STATUS;
+
+	FlashErrors |= status & (MC_FLASH_STATUS_LOCK_ERROR |
+		MC_FLASH_STATUS_PROGRAMMING_ERROR);
+	return (status & MC_FLASH_STATUS_READY) != 0;
+}
+
+//-----------------------------------------------------------------------------
+// Move the page at the tail of the ring along. If the flash controller is
+// idle, copy the page into its latch buffer and start programming it; we
+// run from RAM, so we can go back to USB while it does that. Once it is
+// done, send the page's status (if it wants one, and as soon as EP2 is
+// free, so that we never block on a host that is busy sending us more
+// pages) and free its slot. A boot record that has to change goes first.
+// Returns TRUE if it did something.
+//-----------------------------------------------------------------------------
+static BOOL FlashPoll(void)
+{
+	int i;
+	UsbPageStatus s;
+	PageBuffer *pb;
+	volatile DWORD *p = (volatile DWORD *)FLASH_BASE;
+
+	if(!FlashReady()) {
+		return FALSE;
+	}
+
+	if(BootRecordBusy) {
+		// nobody waits for its status; a failed write leaves the old record
+		BootRecordBusy = FALSE;
+	}
+
+	if(BootRecordPending && !FlashBusy) {
+		BootRecordFill();
+		for(i = 0; i < FLASH_PAGE_SIZE_BYTES/4; i++) {
+			p[i] = BootRecordPage[i];
+		}
+
+		BootRecordPending = FALSE;
+		BootRecordBusy = TRUE;
+		MC_FLASH_COMMAND = MC_FLASH_COMMAND_KEY |
+			MC_FLASH_COMMAND_PAGEN((BOOT_RECORD_ADDR - FLASH_BASE) /
+				FLASH_PAGE_SIZE_BYTES) |
+			FCMD_WRITE_PAGE;
+		return TRUE;
+	}
+
+	if(!PageRingCount) {
+		return FALSE;
+	}
+
+	pb = &PageRing[PageRingTail];
+
+	if(!FlashBusy) {
+		for(i = 0; i < FLASH_PAGE_SIZE_BYTES/4; i++) {
+			p[i] = pb->data[i];
+		}
+
+		FlashErrors = 0;
+		MC_FLASH_COMMAND = MC_FLASH_COMMAND_KEY |
+			MC_FLASH_COMMAND_PAGEN(pb->addr/FLASH_PAGE_SIZE_BYTES) |
+			FCMD_WRITE_PAGE;
+		FlashBusy = TRUE;
+		return TRUE;
+	}
+
+	if(pb->sendStatus) {
+		if(!UsbSendReady()) {
+			return FALSE;
+		}
+
+		s.cmd = CMD_WITH_SEQ(CMD_PAGE_STATUS, pb->seq);
+		s.addr = pb->addr;
+		s.crc = crc32((void *)FLASH_ADDR(pb->addr), FLASH_PAGE_SIZE_BYTES);
+		s.status = FlashErrors;
+		UsbSendPacket((BYTE *)&s, sizeof(s));
+	}
+
+	FlashBusy = FALSE;
+	PageRingTail = (PageRingTail + 1) % PAGE_RING_SIZE;
+	PageRingCount--;
+	return TRUE;
+}
+
+//-----------------------------------------------------------------------------
+// Write everything that is still in the ring, for commands that want to see
+// flash as the host thinks it is.
+//-----------------------------------------------------------------------------
+static void FlashFlush(void)
+{
+	while(PageRingCount || BootRecordPending) {
+		FlashPoll();
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Program one page right away, past the ring, and wait until that's done.
+// Returns the flash controller's error bits.
+//-----------------------------------------------------------------------------
+static DWORD FlashWritePage(DWORD addr, const DWORD *data)
+{
+	int i;
+	volatile DWORD *p = (volatile DWORD *)FLASH_BASE;
+
+	FlashFlush();
+	while(!FlashReady())
+		;
+
+	for(i = 0; i < FLASH_PAGE_SIZE_BYTES/4; i++) {
+		p[i] = data[i];
+	}
+
+	FlashErrors = 0;
+	MC_FLASH_COMMAND = MC_FLASH_COMMAND_KEY |
+		MC_FLASH_COMMAND_PAGEN((FLASH_ADDR(addr) - FLASH_BASE) /
+			FLASH_PAGE_SIZE_BYTES) |
+		FCMD_WRITE_PAGE;
+	while(!FlashReady())
+		;
+
+	return FlashErrors;
+}
+
+//-----------------------------------------------------------------------------
+// Load the slot table from the boot record (see bootrom.h) into Slots;
+// without a record, that's a table with just the application at APP_BASE,
+// not validated. We work on the copy in RAM from then on, so that nothing
+// has to read the record while FlashPoll may be programming a page.
+//-----------------------------------------------------------------------------
+static void BootRecordLoad(void)
+{
+	int i;
+
+	if(BOOT_RECORD->magic == BOOT_RECORD_MAGIC &&
+		BOOT_RECORD->active < BOOT_SLOT_COUNT)
+	{
+		Slots = *BOOT_RECORD;
+		return;
+	}
+
+	Slots.magic = BOOT_RECORD_MAGIC;
+	Slots.active = 0;
+	for(i = 0; i < BOOT_SLOT_COUNT; i++) {
+		Slots.slot[i].base = 0;
+		Slots.slot[i].size = 0;
+		Slots.slot[i].crc = 0;
+		Slots.slot[i].headerSize = 0;
+	}
+	Slots.slot[0].base = APP_BASE;
+}
+
+//-----------------------------------------------------------------------------
+// Build the boot record page from Slots in BootRecordPage.
+//-----------------------------------------------------------------------------
+static void BootRecordFill(void)
+{
+	int i;
+
+	for(i = 0; i < FLASH_PAGE_SIZE_BYTES/4; i++) {
+		BootRecordPage[i] = 0xffffffff;
+	}
+	*(BootRecord *)BootRecordPage = Slots;
+}
+
+//-----------------------------------------------------------------------------
+// Write Slots to the boot record right away; it's one page, so the whole
+// table changes at once. Returns the flash controller's error bits.
+//-----------------------------------------------------------------------------
+static DWORD BootRecordWrite(void)
+{
+	FlashFlush();
+	BootRecordFill();
+
+	return FlashWritePage(BOOT_RECORD_ADDR, BootRecordPage);
+}
+
+//-----------------------------------------------------------------------------
+// The slot with the given base, or -1.
+//-----------------------------------------------------------------------------
+static int BootSlotFind(DWORD base)
+{
+	int i;
+
+	for(i = 0; i < BOOT_SLOT_COUNT; i++) {
+		if(Slots.slot[i].base == base) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+//-----------------------------------------------------------------------------
+// The page at addr is about to be written; if it belongs to a validated
+// slot, that slot isn't validated any more. FlashPoll writes the record
+// before the page.
+//-----------------------------------------------------------------------------
+static void BootSlotForget(DWORD addr)
+{
+	int i;
+
+	for(i = 0; i < BOOT_SLOT_COUNT; i++) {
+		BootSlot *s = &Slots.slot[i];
+		if(s->size != 0 && addr >= s->base && addr - s->base < s->size) {
+			s->size = 0;
+			s->crc = 0;
+			BootRecordPending = TRUE;
+		}
+	}
+}
+
+//-----------------------------------------------------------------------------
+// CMD_VALIDATE_IMAGE: the image at base checked out, so enter it in the slot
+// table, in place of whatever slots it overlaps. Returns VALIDATE_xxx.
+//-----------------------------------------------------------------------------
+static DWORD BootSlotValidate(DWORD base, DWORD size, DWORD crc)
+{
+	int i, n;
+
+	for(i = 0; i < BOOT_SLOT_COUNT; i++) {
+		BootSlot *s = &Slots.slot[i];
+		DWORD len = (s->size > APP_SLOT_ALIGN) ? s->size : APP_SLOT_ALIGN;
+		if(s->base == 0 || s->base == base ||
+			s->base >= base + size || base >= s->base + len)
+		{
+			continue;
+		}
+		s->size = 0;
+		s->crc = 0;
+		if(s->base != APP_BASE) {
+			// the first slot stays in the table, even when it's overwritten
+			s->base = 0;
+		}
+	}
+
+	n = BootSlotFind(base);
+	if(n < 0) {
+		n = BootSlotFind(0);
+	}
+	if(n < 0) {
+		return VALIDATE_NO_SLOT;
+	}
+	if(Slots.slot[Slots.active].base == 0) {
+		Slots.active = n;
+	}
+
+	Slots.slot[n].base = base;
+	Slots.slot[n].size = size;
+	Slots.slot[n].crc = crc;
+	Slots.slot[n].headerSize = APP_HEADER(base)[1];
+
+	return BootRecordWrite() ? VALIDATE_FLASH_ERROR : VALIDATE_OK;
+}
+
+//-----------------------------------------------------------------------------
+// Called by the USB driver before it takes a packet from the UDP; it has to
+// stay in the UDP while we have nowhere to put it.
+//-----------------------------------------------------------------------------
+BOOL UsbReadyToReceive(void)
+{
+	if(LzInPos < LzInLen) {
+		// the decompressor is still busy with the last report
+		return FALSE;
+	}
+	if(StreamMode == STREAM_FILL && StreamPages) {
+		// no data belongs to this transfer; wait until it is done
+		return FALSE;
+	}
+	return PageRingCount < PAGE_RING_SIZE;
+}
+
 void UsbPacketReceived(BYTE *packet, int len)
 {
 	int i;
@@ -92,17 +640,33 @@ void UsbPacketReceived(BYTE *packet, int len)
 		Fatal();
 	}
 
-	switch(c->cmd) {
+	BootMark(BOOT_STAGE_FIRST_COMMAND);
+
+	if(StreamPages) {
+		if(StreamMode == STREAM_LZ) {
+			LzPacketReceived(packet);
+		} else {
+			StreamPacketReceived(packet);
+		}
+		return;
+	}
+
+	switch(CMD_CODE(c->cmd)) {
 		case CMD_DEVICE_INFO:
+			FlashFlush();
 			c->ext1 = CMD_VERSION;
 			// copy size of the bootloader (if tag matches)
 			c->ext2 = (*(DWORD*)0x100208 == 0xb007c0de) ? *(DWORD*)0x10020c : 0;
 			// copy size of the arm firmware (if recent enough)
 			c->ext3 = (*(DWORD*)0x102020 == 0x600dc0de) ? *(DWORD*)0x102024 : 0;
+			// how many CMD_WRITE_PAGES pages the host may have outstanding
+			c->d.asDwords[0] = PAGE_RING_SIZE;
+			// and how we got here
+			c->d.asDwords[1] = BootWarm ? BOOT_ENTRY_WARM : 0;
 			break;
 
 		case CMD_SETUP_WRITE:
-			p = (volatile DWORD *)0;
+			p = PageRing[PageRingHead].data;
 			for(i = 0; i < 12; i++) {
 				p[i+c->ext1] = c->d.asDwords[i];
 			}
@@ -110,41 +674,332 @@ void UsbPacketReceived(BYTE *packet, int len)
 			break;
 
 		case CMD_FINISH_WRITE:
-			p = (volatile DWORD *)0;
+			p = PageRing[PageRingHead].data;
 			for(i = 0; i < 4; i++) {
 				p[i+60] = c->d.asDwords[i];
 			}
-
-			MC_FLASH_COMMAND = MC_FLASH_COMMAND_KEY |
-				MC_FLASH_COMMAND_PAGEN(c->ext1/FLASH_PAGE_SIZE_BYTES) |
-				FCMD_WRITE_PAGE;
-			while(!(MC_FLASH_STATUS & MC_FLASH_STATUS_READY))
-				;
+			// FlashPoll writes it; the ACK doesn't have to wait for that
+			QueuePage(c->ext1, 0, FALSE);
 
 			c->ext1 = crc32(c->d.asDwords, 4 * sizeof(c->d.asDwords[0]));
 			break;
 
 		case CMD_HARDWARE_RESET:
+			// the host is done with us
+			FlashFlush();
+			if(c->ext1 == HARDWARE_RESET_REBOOT) {
+				ResetPending = TRUE;
+				c->ext1 = HARDWARE_RESET_OK;
+			} else if(AppStartable()) {
+				StartPending = TRUE;
+				c->ext1 = HARDWARE_RESET_OK;
+			} else {
+				c->ext1 = HARDWARE_RESET_NO_APP;
+			}
 			break;
 
 		case CMD_CRC32_MEMORY:
 		{
-			void *p = (void*)c->ext1;
+			void *p = (void*)FLASH_ADDR(c->ext1);
 			unsigned int len = c->ext2;
-			unsigned int crc = crc32(p,len);
+			unsigned int crc;
+			FlashFlush();
+			DWORD start = PIT_IMAGE;
+			if(c->ext3 & CRC32_MEMORY_BITWISE) {
+				crc = crc32_bitwise(p,len);
+			} else {
+				crc = crc32(p,len);
+			}
 			c->ext1 = crc;
+			// PIT ticks are MCK/16
+			c->ext2 = (PIT_IMAGE - start) * 16;
+			break;
+		}
+
+		case CMD_CRC32_PAGES:
+			FlashFlush();
+			if(c->ext2 > CRC32_PAGES_MAX) {
+				Fatal();
+			}
+			for(i = 0; i < (int)c->ext2; i++) {
+				c->d.asDwords[i] = crc32((void *)FLASH_ADDR(c->ext1 +
+					i*FLASH_PAGE_SIZE_BYTES), FLASH_PAGE_SIZE_BYTES);
+			}
+			break;
+
+		case CMD_VALIDATE_IMAGE:
+		{
+			DWORD size = c->ext1;
+			DWORD crc = c->ext2;
+			DWORD base = c->ext3 ? c->ext3 : APP_BASE;
+
+			FlashFlush();
+			if(base < APP_BASE || base >= APP_END ||
+				(base - APP_BASE) % APP_SLOT_ALIGN)
+			{
+				c->ext1 = 0;
+				c->ext2 = VALIDATE_NO_SLOT;
+				break;
+			}
+			if(size > APP_END - base) {
+				size = APP_END - base;
+			}
+			c->ext1 = crc32((void *)base, size);
+			if(APP_HEADER(base)[0] != APP_TAG || size < 0x28) {
+				c->ext2 = VALIDATE_NO_TAG;
+			} else if(c->ext1 != crc) {
+				c->ext2 = VALIDATE_CRC_MISMATCH;
+			} else {
+				c->ext2 = BootSlotValidate(base, size, crc);
+			}
 			break;
 		}
 
+		case CMD_BOOT_SLOTS:
+			FlashFlush();
+			c->ext2 = SLOTS_OK;
+			if(c->ext1 != 0) {
+				i = BootSlotFind(c->ext1);
+				if(i < 0) {
+					c->ext2 = SLOTS_UNKNOWN;
+				} else if(Slots.active != (DWORD)i) {
+					Slots.active = i;
+					if(BootRecordWrite()) {
+						c->ext2 = SLOTS_FLASH_ERROR;
+					}
+				}
+				if(i >= 0) {
+					// and that's where the timeout goes to now, too
+					BOOT_MAILBOX->base = c->ext1;
+				}
+			}
+			c->ext1 = Slots.active;
+			c->ext3 = BOOT_MAILBOX->base;
+			for(i = 0; i < BOOT_SLOT_COUNT; i++) {
+				c->d.asDwords[i*3] = Slots.slot[i].base;
+				c->d.asDwords[i*3+1] = Slots.slot[i].size;
+				c->d.asDwords[i*3+2] = Slots.slot[i].crc;
+			}
+			break;
+
+		case CMD_BOOT_TIMELINE:
+			c->ext1 = BOOT_STAGE_COUNT;
+			c->ext2 = BOOT_TIMELINE->pll;
+			c->ext3 = PMC_MAIN_CLK_FREQUENCY & 0xffff;
+			for(i = 0; i < BOOT_STAGE_COUNT; i++) {
+				c->d.asDwords[i] = BOOT_TIMELINE->stamp[i];
+			}
+			break;
+
+		case CMD_USB_STATISTICS:
+			c->ext1 = USB_STAT_COUNT;
+			UsbGetStatistics(c->d.asDwords);
+			break;
+
+		case CMD_WRITE_PAGES:
+			if(c->ext1 & (FLASH_PAGE_SIZE_BYTES-1)) {
+				Fatal();
+			}
+			StreamAddr = c->ext1;
+			StreamSeq = CMD_SEQ(c->cmd);
+			StreamOffset = 0;
+			StreamPages = c->ext2;
+			StreamMode = STREAM_RAW;
+			// no ACK; the data follows straight away
+			return;
+
+		case CMD_WRITE_COMPRESSED:
+			if(c->ext1 & (FLASH_PAGE_SIZE_BYTES-1)) {
+				Fatal();
+			}
+			StreamAddr = c->ext1;
+			StreamSeq = CMD_SEQ(c->cmd);
+			StreamOffset = 0;
+			StreamPages = c->ext2;
+			StreamMode = STREAM_LZ;
+			Lz.outPos = 0;
+			Lz.flags = 1;
+			Lz.haveFirst = FALSE;
+			Lz.matchLeft = 0;
+			// no ACK either
+			return;
+
+		case CMD_FILL_PAGES:
+			if(c->ext1 & (FLASH_PAGE_SIZE_BYTES-1)) {
+				Fatal();
+			}
+			StreamAddr = c->ext1;
+			StreamSeq = CMD_SEQ(c->cmd);
+			StreamOffset = 0;
+			StreamPages = c->ext2;
+			StreamFill = c->ext3;
+			StreamMode = STREAM_FILL;
+			FillPoll();
+			// no ACK; just the page status for every page
+			return;
+
 		default:
 			Fatal();
 			break;
 	}
 
-	c->cmd = CMD_ACK;
+	c->cmd = CMD_WITH_SEQ(CMD_ACK, CMD_SEQ(c->cmd));
 	UsbSendPacket(packet, len);
 }
 
+//-----------------------------------------------------------------------------
+// Wait for at least us microseconds, on the PIT that Bootrom() starts; it
+// counts MCK/16, three ticks to the microsecond.
+//-----------------------------------------------------------------------------
+void DelayUs(DWORD us)
+{
+	DWORD start = PIT_IMAGE;
+
+	while(PIT_IMAGE - start < us * 3)
+		;
+}
+
+//-----------------------------------------------------------------------------
+// Note the time at which we first got to the given stage of the boot, in
+// the timeline that the first stage started.
+//-----------------------------------------------------------------------------
+void BootMark(int stage)
+{
+	if(BOOT_TIMELINE->stamp[stage] == BOOT_STAMP_NONE) {
+		BOOT_TIMELINE->stamp[stage] = PIT_IMAGE;
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Interrupts. The core takes them through the vector table at the start of
+// our image (see ram-reset.s), so RAM has to be remapped to address 0 first;
+// IrqStop undoes that again before we jump to the application, which
+// expects flash there. The drivers set up their own sources in the AIC.
+//-----------------------------------------------------------------------------
+static BOOL IrqRemapped;
+
+static void SpuriousIrq(void)
+{
+}
+
+static void IrqStart(void)
+{
+	AIC_INTERRUPT_DISABLE = 0xffffffff;
+	AIC_INTERRUPT_CLEAR = 0xffffffff;
+	AIC_SPURIOUS_VECTOR = (DWORD)SpuriousIrq;
+
+	// The IRQ vector in flash branches to the application. If it's already
+	// ours, then somebody (a debugger) did the remap for us.
+	IrqRemapped = FALSE;
+	if(*(volatile DWORD *)0x00000018 != *(volatile DWORD *)0x00200018) {
+		MC_REMAP = MC_REMAP_TOGGLE;
+		IrqRemapped = TRUE;
+	}
+
+	IrqEnable();
+}
+
+static void IrqStop(void)
+{
+	IrqDisable();
+	AIC_INTERRUPT_DISABLE = 0xffffffff;
+	if(IrqRemapped) {
+		MC_REMAP = MC_REMAP_TOGGLE;
+		IrqRemapped = FALSE;
+	}
+}
+
+//-----------------------------------------------------------------------------
+// How long to wait for the downloader before we start the application. The
+// config word in our header (see ram-reset.s) may set the timeout. If we
+// only run because of always_connect, after a power-up or the reset
+// button, then there is no point in waiting when no host resets the bus
+// within HOST_DETECT_MS. Someone holding down the key, or an application
+// that ran into the watchdog or reset us on purpose, gets the full time.
+// An application that asked for download mode through the mailbox sets
+// the time itself, and 0 (BootTimeoutBlinks = 0) means no timeout at all;
+// its timeout only runs until a host is on the bus.
+//-----------------------------------------------------------------------------
+#define HOST_DETECT_MS              1000
+#define BOOT_BLINK_TICKS            30000   // PWM ticks at 46.875 kHz, 0.64 s
+#define BOOT_DEFAULT_BLINKS         20
+
+static int BootTimeoutBlinks;
+static BOOL BootNeedsHost;
+
+static void BootPolicy(void)
+{
+	DWORD config = *(DWORD*)0x200010;
+	DWORD cause = RST_STATUS_TYPE(RSTC_STATUS);
+	DWORD secs = BOOT_CONFIG_TIMEOUT(config);
+
+	BootWarm = FALSE;
+	if(BOOT_MAILBOX->magic == BOOT_MAILBOX_MAGIC) {
+		BOOT_MAILBOX->magic = 0;
+		if(BOOT_MAILBOX->request == BOOT_REQUEST_DOWNLOAD) {
+			BootWarm = TRUE;
+			BootTimeoutBlinks = (BOOT_MAILBOX->arg * 25 + 15) / 16;
+			BootNeedsHost = FALSE;
+			return;
+		}
+	}
+
+	if(secs) {
+		BootTimeoutBlinks = (secs * 25) / 16;
+	} else {
+		BootTimeoutBlinks = BOOT_DEFAULT_BLINKS;
+	}
+
+	BootNeedsHost = (config & BOOT_CONFIG_ALWAYS_CONNECT) &&
+		(PIO_PIN_DATA_STATUS & (1<<GPIO_KEY)) &&
+		(cause == RST_TYPE_POWER_UP || cause == RST_TYPE_USER);
+}
+
+//-----------------------------------------------------------------------------
+// With validated boot, we don't start an application that CMD_VALIDATE_IMAGE
+// hasn't vouched for; we stay and wait for the downloader instead.
+//-----------------------------------------------------------------------------
+static BOOL AppStartable(void)
+{
+	int i;
+
+	if(!(*(DWORD*)0x200010 & BOOT_CONFIG_VALIDATE)) {
+		return TRUE;
+	}
+	i = BootSlotFind(BOOT_MAILBOX->base);
+	return i >= 0 && SLOT_VALIDATED(&Slots.slot[i]);
+}
+
+//-----------------------------------------------------------------------------
+// Leave the bootloader for good, for the application in the slot that the
+// first stage picked (or that CMD_BOOT_SLOTS chose since).
+//-----------------------------------------------------------------------------
+static void StartApplication(void)
+{
+	BootMark(BOOT_STAGE_JUMP_TO_APP);
+	USB_D_PLUS_PULLUP_OFF();
+	LED_OFF();
+	IrqStop();
+
+	CallApp(BOOT_MAILBOX->base);
+}
+
+//-----------------------------------------------------------------------------
+// Reset the processor and the peripherals, to start over from the first
+// stage in flash (which may be new). RAM, and with it the mailbox, stays.
+//-----------------------------------------------------------------------------
+static void Reboot(void)
+{
+	USB_D_PLUS_PULLUP_OFF();
+	LED_OFF();
+	IrqStop();
+
+	RSTC_CONTROL = RST_CONTROL_KEY | RST_CONTROL_PROCESSOR_RESET |
+		RST_CONTROL_PERIPHERAL_RESET;
+	for(;;)
+		;
+}
+
 void Bootrom(void)
 {
 
@@ -172,11 +1027,22 @@ void Bootrom(void)
 	// stack setup?
 	USB_D_PLUS_PULLUP_OFF();
 
-	int always_connect_usb = 0x1 & *(DWORD*)0x200010;
+	StreamPages = 0;
+	StreamMode = STREAM_RAW;
+	PageRingHead = 0;
+	PageRingTail = 0;
+	PageRingCount = 0;
+	FlashBusy = FALSE;
+	BootRecordPending = FALSE;
+	BootRecordBusy = FALSE;
+	LzInPos = LzInLen = 0;
+	IrqRemapped = FALSE;
+	StartPending = FALSE;
+	ResetPending = FALSE;
 
-	for(i = 0; i < 10000; i++) LED_OFF(); // delay a bit, before testing the key
-
-	if (!always_connect_usb && PIO_PIN_DATA_STATUS&(1<<GPIO_KEY)) goto run_flash;
+	// The first stage (fromflash.c) already looked at the key, at the
+	// always_connect bit and at the mailbox; we only get here if one of
+	// them asked for us (or if we were loaded over JTAG).
 
 	// disable watchdog
 	WDT_MODE = WDT_MODE_DISABLE;
@@ -190,7 +1056,35 @@ void Bootrom(void)
 	// Careful, a lot of peripherals can't be configured until the PLL clock
 	// comes up; you write to the registers but it doesn't stick.
 	ConfigClocks();
+	CrcInit();
+
+	// The PIT runs free at MCK/16, for DelayUs, the boot timeline and the
+	// USB driver's timestamps. With PIV at 0xfffff, CPIV wraps to 0 every
+	// 2^20 ticks and bumps PICNT, so PIT_IMAGE (PICNT:CPIV) reads as one
+	// 32 bit counter; the interrupt stays disabled. The first stage
+	// started it at reset, and the application finds it still running.
+	PIT_MODE = PIT_MODE_INTERVAL(0xfffff) | PIT_MODE_ENABLE;
+
+	if(BOOT_TIMELINE->magic != BOOT_TIMELINE_MAGIC) {
+		// loaded over JTAG; the PIT starts now, on the PLL
+		BOOT_TIMELINE->magic = BOOT_TIMELINE_MAGIC;
+		BOOT_TIMELINE->pll = 0;
+		for(i = 0; i < BOOT_STAGE_COUNT; i++) {
+			BOOT_TIMELINE->stamp[i] = BOOT_STAMP_NONE;
+		}
+	}
+
+	BootRecordLoad();
+	if(BOOT_TIMELINE->stamp[BOOT_STAGE_RESET] == BOOT_STAMP_NONE) {
+		// loaded over JTAG, so no slot was picked; take the default one
+		BOOT_MAILBOX->base = Slots.slot[Slots.active].base;
+	}
+
+	BootPolicy();
+
+	IrqStart();
 	UsbStart();
+	DWORD connected = PIT_IMAGE;
 
 	// Borrow a PWM unit for my real-time clock
 	PWM_ENABLE = PWM_CHANNEL(0);
@@ -206,38 +1100,44 @@ void Bootrom(void)
 
 		WORD now = (SWORD)PWM_CH_COUNTER(0);
 
-		if(UsbPoll()) {
+		if(UsbPoll() | FlashPoll() | StreamPoll()) {
 			// It did something; reset the clock that would jump us to the
 			// applications.
 			start = now;
 		}
 
 		WDT_HIT();
-		if((SWORD)(now - start) > 30000) {
+		if((StartPending || ResetPending) && UsbSendReady()) {
+			FlashFlush();
+			if(ResetPending) {
+				Reboot();
+			}
+			StartApplication();
+		}
+
+		if(BootNeedsHost && !UsbHostPresent() &&
+			PIT_IMAGE - connected > HOST_DETECT_MS * 3000 && AppStartable())
+		{
+			// nobody there to download anything
+			StartApplication();
+		}
+
+		if(BootWarm && UsbHostPresent()) {
+			// The host that the application sent us here for is on the
+			// bus; from now on we wait for its CMD_HARDWARE_RESET.
+			BootTimeoutBlinks = 0;
+		}
+
+		if((SWORD)(now - start) > BOOT_BLINK_TICKS) {
 			i=i+1;
 			if (i&1) LED_OFF();
 			else LED_ON();
 
-			// you may increase the number below if the enumeration process
-			// in Windows is longer and the downloader does not work...)
-			if (i>20) { //after ~10sec or no keypress
-run_flash:
-				USB_D_PLUS_PULLUP_OFF();
-				LED_OFF();
-
-				// This is a function call to 0x00102001, the application reset
-				// vector, which is equal to (0x81 << 13)+1.
-				//
-				// I would have thought that I could write this as a cast to
-				// a function pointer and a call, but I can't seem to get that
-				// to work. I also can't figure out how to make the assembler
-				// load pc relative a constant in flash, thus the ugly way
-				// to specify the address.
-				asm("mov r3, #129\n");
-				asm("lsl r3, r3, #13\n");
-				//asm("mov r4, #1\n");  // we don't need this!
-				//asm("orr r3, r4\n");
-				asm("bx r3\n");
+			// you may increase the timeout (see BootPolicy) if the
+			// enumeration process in Windows is longer and the downloader
+			// does not work...)
+			if (BootTimeoutBlinks && i>BootTimeoutBlinks && AppStartable()) {
+				StartApplication();
 			} else {
 				start = now;
 			}
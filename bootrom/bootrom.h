@@ -15,17 +15,88 @@
         PIO_OUTPUT_ENABLE = (1<<GPIO_USB_PU); \
     }
 
+// The boot timeline; see usb_cmd.h.
+#define BOOT_TIMELINE       ((volatile BootTimeline *)BOOT_TIMELINE_ADDR)
+
+// The bits of the config word in the image header (see ram-reset.s).
+#define BOOT_CONFIG_ALWAYS_CONNECT  (1<<0)
+#define BOOT_CONFIG_VALIDATE        (1<<1)
+#define BOOT_CONFIG_FAST_START      (1<<2)
+#define BOOT_CONFIG_TIMEOUT(x)      (((x)>>8)&0xff)
+
+// The boot mailbox; see usb_cmd.h.
+#define BOOT_MAILBOX        ((volatile BootMailbox *)BOOT_MAILBOX_ADDR)
+
+// The applications (see usb_cmd.h for the slots), and their header: the
+// tag 0x600dc0de and the size, 0x20 bytes into the image. The first slot
+// is always at APP_BASE.
+#define APP_BASE            0x00102000
+#define APP_END             0x00140000
+#define APP_HEADER(base)    ((const DWORD *)((base) + 0x20))
+#define APP_TAG             0x600dc0de
+#define APP_SLOT_ALIGN      0x2000
+
+// The boot record, in the last flash page before the application: the
+// slot table, with what CMD_VALIDATE_IMAGE checked for each slot. Any
+// write to a slot clears its size; a slot with a zero base is unused.
+typedef struct {
+    DWORD       base;           // where the image starts
+    DWORD       size;           // bytes from base that were checked
+    DWORD       crc;            // and their CRC32
+    DWORD       headerSize;     // the size in the application's header
+} BootSlot;
+
+typedef struct {
+    DWORD       magic;          // BOOT_RECORD_MAGIC
+    DWORD       active;         // the slot that starts by default
+    BootSlot    slot[BOOT_SLOT_COUNT];
+} BootRecord;
+
+#define BOOT_RECORD_ADDR    0x00101f00
+#define BOOT_RECORD         ((const BootRecord *)BOOT_RECORD_ADDR)
+#define BOOT_RECORD_MAGIC   0x7a11d8ee
+
+// For a bootrom built with BOOT_CONFIG_VALIDATE: is there an application
+// with its tag in slot s, and did CMD_VALIDATE_IMAGE check it? This doesn't
+// touch the rest of the image, so it's quick enough for every boot. The
+// base is checked first, so that a broken record can't make us read the
+// header from anywhere but an application slot.
+#define SLOT_VALIDATED(s) \
+    ((s)->base >= APP_BASE && (s)->base < APP_END && \
+     ((s)->base & (APP_SLOT_ALIGN - 1)) == 0 && \
+     (s)->size != 0 && (s)->size <= APP_END - (s)->base && \
+     APP_HEADER((s)->base)[0] == APP_TAG && \
+     (s)->headerSize == APP_HEADER((s)->base)[1])
+
 #define LED_ON()            PIO_OUTPUT_DATA_CLEAR = (1<<GPIO_LED)
 #define LED_OFF()           PIO_OUTPUT_DATA_SET = (1<<GPIO_LED)
 
+// These are in bootrom.c.
+void DelayUs(DWORD us);
+void BootMark(int stage);
+
+// These are in ram-reset.s.
+void IrqEnable(void);
+void IrqDisable(void);
+void CallApp(DWORD base);
+
+// These are in crc.c.
+void CrcInit(void);
+DWORD crc32(const void *memory, DWORD length);
+
 // These are functions that the USB driver provides.
 void UsbStart(void);
 BOOL UsbPoll(void);
 void UsbSendPacket(BYTE *packet, int len);
+BOOL UsbSendReady(void);
+void UsbGetStatistics(DWORD *stats);
+BOOL UsbHostPresent(void);
+void UsbIrqHandler(void);
 
 // These are functions that the USB driver calls, that the code that uses
 // it provides.
 void UsbPacketReceived(BYTE *data, int len);
+BOOL UsbReadyToReceive(void);
 
 #endif
 
@@ -0,0 +1,62 @@
+//-----------------------------------------------------------------------------
+// CRC32 (the one from zlib, which is what the loader computes too) for the
+// bootrom. This is table driven, a byte at a time, and reads the data a word
+// at a time; each flash access costs a wait state, so four byte reads from
+// flash are much worse than one word read. The table is 1 kB, so it lives
+// in bss and is computed by CrcInit instead of taking up a quarter of the
+// 4 kB image that gets copied into RAM.
+//
+// This file is compiled as ARM code, not Thumb: we run from RAM, which has
+// no wait states and a 32 bit bus, so the wider instructions are free, and
+// the loop gets all of the registers and the barrel shifter.
+//-----------------------------------------------------------------------------
+#include <bootrom.h>
+
+static DWORD CrcTable[256];
+
+void CrcInit(void)
+{
+	DWORD c;
+	int i, j;
+
+	for(i = 0; i < 256; i++) {
+		c = i;
+		for(j = 0; j < 8; j++) {
+			c = (c & 1) ? (c >> 1) ^ 0xEDB88320 : (c >> 1);
+		}
+		CrcTable[i] = c;
+	}
+}
+
+#define CRC_BYTE(crc, b) \
+	((crc) = CrcTable[((crc) ^ (b)) & 0xff] ^ ((crc) >> 8))
+
+DWORD crc32(const void *memory, DWORD length)
+{
+	const BYTE *p = (const BYTE *)memory;
+	DWORD crc = 0xffffffff;
+	DWORD w;
+
+	while(length > 0 && ((DWORD)p & 3)) {
+		CRC_BYTE(crc, *p++);
+		length--;
+	}
+
+	// The ARM is little endian, so the first byte is in the low bits.
+	while(length >= 4) {
+		w = *(const DWORD *)p;
+		CRC_BYTE(crc, w);
+		CRC_BYTE(crc, w >> 8);
+		CRC_BYTE(crc, w >> 16);
+		CRC_BYTE(crc, w >> 24);
+		p += 4;
+		length -= 4;
+	}
+
+	while(length > 0) {
+		CRC_BYTE(crc, *p++);
+		length--;
+	}
+
+	return ~crc;
+}
@@ -4,6 +4,10 @@
 .code 32
 .align 0
 
+@ Exceptions go straight to the vector table of the application in the
+@ first slot, one 8 byte entry per vector from the start of its image, as
+@ they always have. An application in any other slot has to map RAM to 0
+@ (MC_REMAP) and put its own vectors there before it takes an exception.
 .global start
 start:
     b       Reset
@@ -19,25 +23,35 @@ length:
   .word     __rodata_end__
 
 Reset:
-    ldr     sp,     = 0x00203ff8
+@ the boot timeline (see usb_cmd.h) sits above the stack
+    ldr     sp,     = 0x00203f78
     bl      CMain
 
-Fiq:
-    b       Fiq
-UndefinedInstruction:
-    b       UndefinedInstruction
-SoftwareInterrupt:
-    b       SoftwareInterrupt
-PrefetchAbort:
-    b       PrefetchAbort
-DataAbort:
-    b       DataAbort
-Reserved:
-    b       Reserved
-Irq:
-    b       Irq
+@ Copy r2 bytes (a multiple of 32, at least 32) from r1 to r0, eight words
+@ per ldm/stm burst, and kick the watchdog once per burst.
+.global CopyBlocks
+.type CopyBlocks, %function
+CopyBlocks:
+    stmfd   sp!,    {r4-r11}
+    ldr     r12,    = 0xfffffd40
+    ldr     r11,    = 0xa5000001
+CopyBlock:
+    ldmia   r1!,    {r3-r10}
+    stmia   r0!,    {r3-r10}
+    str     r11,    [r12]
+    subs    r2,     r2,     #32
+    bhi     CopyBlock
+    ldmfd   sp!,    {r4-r11}
+    bx      lr
 
 .global CallRam
+.type CallRam, %function
 CallRam:
     ldr     r3,     = 0x00200000
     bx      r3
+
+@ Start the application whose base is in r0, in ARM state.
+.global CallApp
+.type CallApp, %function
+CallApp:
+    bx      r0
@@ -1,11 +1,28 @@
 #include <bootrom.h>
 
 extern void CallRam(void);
+extern void CallApp(DWORD base);
+extern void CopyBlocks(void *dest, const void *src, DWORD len);
+
+// The second stage, as it sits in flash and where it runs from. Its header
+// (see ram-reset.s) has the tag 0xB007C0DE in word 2, the size of the
+// image in word 3 and the config word in word 4; it can't be any bigger
+// than the space up to the boot record at 0x101f00.
+#define RAM_IMAGE_FLASH     ((const DWORD *)0x200)
+#define RAM_IMAGE_RAM       ((DWORD *)0x00200000)
+#define RAM_IMAGE_MAX       0x1d00
+
+// The clocks as ConfigClocks sets them up, and Bootrom() keeps them.
+#define PLL_SETTING         (PMC_PLL_DIVISOR(14) | \
+                             PMC_PLL_COUNT_BEFORE_LOCK(16) | \
+                             PMC_PLL_FREQUENCY_RANGE(0) | \
+                             PMC_PLL_MULTIPLIER(73) | \
+                             PMC_PLL_USB_DIVISOR(1))
+#define MASTER_CLK_SETTING  (PMC_CLK_SELECTION_PLL_CLOCK | \
+                             PMC_CLK_PRESCALE_DIV_2)
 
 static void ConfigClocks(void)
 {
-    volatile int i;
-
     // we are using a 18.432 MHz crystal as the basis for everything
     PMC_SYS_CLK_ENABLE = PMC_SYS_CLK_PROCESSOR_CLK | PMC_SYS_CLK_UDP_CLK;
 
@@ -17,40 +34,124 @@ static void ConfigClocks(void)
         (1<<PERIPH_PWMC) |
         (1<<PERIPH_UDP);
 
+    // An application that sent us back to download mode (see BootMailbox)
+    // may have left the clocks just as we would set them up.
+    if(PMC_PLL == PLL_SETTING && PMC_MASTER_CLK == MASTER_CLK_SETTING) {
+        BOOT_TIMELINE->pll = 0;
+        return;
+    }
+
+    // Off whatever clock it runs from now, before anything changes under it;
+    // the PMC wants the source and the prescaler changed one at a time. The
+    // timeline counts at slow clock/16 until the PLL is in, so the prescaler
+    // has to end up at 1.
+    PMC_MASTER_CLK = PMC_CLK_SELECTION_SLOW_CLOCK |
+        (PMC_MASTER_CLK & PMC_CLK_PRESCALE_MASK);
+    while(!(PMC_INTERRUPT_STATUS & PMC_STATUS_MASTER_CLK_READY))
+        ;
+    PMC_MASTER_CLK = PMC_CLK_SELECTION_SLOW_CLOCK | PMC_CLK_PRESCALE_DIV_1;
+    while(!(PMC_INTERRUPT_STATUS & PMC_STATUS_MASTER_CLK_READY))
+        ;
+
+    // 6 * 8 slow clocks, about 1.5 ms, as in Atmel's own startup code for
+    // this crystal; the PMC tells us when it's over.
     PMC_MAIN_OSCILLATOR = PMC_MAIN_OSCILLATOR_ENABLE |
-        PMC_MAIN_OSCILLATOR_STARTUP_DELAY(0x40);
+        PMC_MAIN_OSCILLATOR_STARTUP_DELAY(6);
+    while(!(PMC_INTERRUPT_STATUS & PMC_STATUS_MAIN_OSCILLATOR_READY))
+        ;
+    BOOT_TIMELINE->stamp[BOOT_STAGE_OSCILLATOR_UP] = PIT_IMAGE;
 
     // TODO: THIS DEPENDS ON THE CRYSTAL FREQUENCY THAT YOU CHOOSE. Make
     // the ARM run at some reasonable speed, and make the USB peripheral
     // run at exactly 48 MHz.
 	
-    // minimum PLL clock frequency is 80 MHz in range 00 (96 here so okay)
-    PMC_PLL = PMC_PLL_DIVISOR(14) | PMC_PLL_COUNT_BEFORE_LOCK(28) |
-        PMC_PLL_FREQUENCY_RANGE(0) | PMC_PLL_MULTIPLIER(73) |
-        PMC_PLL_USB_DIVISOR(1);
-
-    // let the PLL spin up, plenty of time
-    for(i = 0; i < 100; i++)
+    // minimum PLL clock frequency is 80 MHz in range 00 (96 here so okay);
+    // this is the same setting as Bootrom() uses, so it can keep it
+    PMC_PLL = PLL_SETTING;
+    while(!(PMC_INTERRUPT_STATUS & PMC_STATUS_PLL_LOCKED))
         ;
+    BOOT_TIMELINE->stamp[BOOT_STAGE_PLL_LOCKED] = PIT_IMAGE;
 
-    PMC_MASTER_CLK = PMC_CLK_SELECTION_SLOW_CLOCK | PMC_CLK_PRESCALE_DIV_2;
-
-    for(i = 0; i < 100; i++)
+    BOOT_TIMELINE->pll = PIT_IMAGE;
+    PMC_MASTER_CLK = MASTER_CLK_SETTING;
+    while(!(PMC_INTERRUPT_STATUS & PMC_STATUS_MASTER_CLK_READY))
         ;
+}
 
-    PMC_MASTER_CLK = PMC_CLK_SELECTION_PLL_CLOCK | PMC_CLK_PRESCALE_DIV_2;
+//-----------------------------------------------------------------------------
+// Which application to start: the slot that the mailbox asks for, just this
+// once, or else the default one from the slot table. Returns 0 if there is
+// no slot table, for the one application at APP_BASE.
+//-----------------------------------------------------------------------------
+static const BootSlot *PickSlot(void)
+{
+    DWORD n = BOOT_RECORD->active;
+
+    if(BOOT_MAILBOX->magic == BOOT_MAILBOX_MAGIC &&
+        BOOT_MAILBOX->request == BOOT_REQUEST_SLOT)
+    {
+        BOOT_MAILBOX->magic = 0;
+        if(BOOT_MAILBOX->arg < BOOT_SLOT_COUNT) {
+            n = BOOT_MAILBOX->arg;
+        }
+    }
 
-    for(i = 0; i < 100; i++)
-        ;
+    if(BOOT_RECORD->magic != BOOT_RECORD_MAGIC || n >= BOOT_SLOT_COUNT ||
+        BOOT_RECORD->slot[n].base == 0)
+    {
+        return 0;
+    }
+    return &BOOT_RECORD->slot[n];
 }
 
-
 void CMain(void)
 {
-    int i;
+    DWORD len;
+    const BootSlot *slot;
+    BOOL app;
+    volatile int i;
 
-    volatile DWORD *src = (volatile DWORD *)0x200;
-    volatile DWORD *dest = (volatile DWORD *)0x00200000;
+    // Start the PIT (with the same interval as Bootrom() uses, so that it
+    // doesn't have to restart it) for the boot timeline.
+    PIT_MODE = PIT_MODE_INTERVAL(0xfffff) | PIT_MODE_ENABLE;
+    BOOT_TIMELINE->magic = BOOT_TIMELINE_MAGIC;
+    BOOT_TIMELINE->pll = BOOT_STAMP_NONE;
+    for(i = 0; i < BOOT_STAGE_COUNT; i++) {
+        BOOT_TIMELINE->stamp[i] = BOOT_STAMP_NONE;
+    }
+    BOOT_TIMELINE->stamp[BOOT_STAGE_RESET] = PIT_IMAGE;
+
+    slot = PickSlot();
+    BOOT_MAILBOX->base = slot ? slot->base : APP_BASE;
+
+    // Unless the key is held down or the image says to always connect, we
+    // don't need the second stage at all. The key's pull-up has been on
+    // since reset, so reading it just takes the PIO clock. With validated
+    // boot, an application that CMD_VALIDATE_IMAGE hasn't vouched for gets
+    // the bootloader instead. A request that is still in the mailbox is for
+    // the second stage (BOOT_REQUEST_DOWNLOAD).
+    app = FALSE;
+    if(!(RAM_IMAGE_FLASH[4] & BOOT_CONFIG_ALWAYS_CONNECT) &&
+        BOOT_MAILBOX->magic != BOOT_MAILBOX_MAGIC &&
+        (!(RAM_IMAGE_FLASH[4] & BOOT_CONFIG_VALIDATE) ||
+            (slot && SLOT_VALIDATED(slot))))
+    {
+        PMC_PERIPHERAL_CLK_ENABLE = (1<<PERIPH_PIOA);
+        PIO_ENABLE = (1<<GPIO_KEY);
+
+        // let it settle; a few milliseconds at 32 kHz
+        for(i = 0; i < 10; i++)
+            ;
+
+        app = (PIO_PIN_DATA_STATUS & (1<<GPIO_KEY)) != 0;
+    }
+
+    // With fast_start, the application gets the chip as it came out of
+    // reset, still running from the slow clock.
+    if(app && (RAM_IMAGE_FLASH[4] & BOOT_CONFIG_FAST_START)) {
+        BOOT_TIMELINE->stamp[BOOT_STAGE_JUMP_TO_APP] = PIT_IMAGE;
+        CallApp(BOOT_MAILBOX->base);
+    }
 
 	// Configure the flash that we are running out of (soon).
 	MC_FLASH_MODE = MC_FLASH_MODE_FLASH_WAIT_STATES(1) |
@@ -58,10 +159,30 @@ void CMain(void)
 
     ConfigClocks();
 
-    for(i = 0; i < 1024; i++) {
-        *dest++ = *src++;
-        WDT_HIT();
+    // Otherwise it gets the PLL, and the pins set up as Bootrom() sets them
+    // up before it would have looked at the key: the LED and the USB pull-up
+    // are outputs, both off.
+    if(app) {
+        PIO_NO_PULL_UP_ENABLE = (1<<GPIO_LED);
+        PIO_ENABLE = (1<<GPIO_KEY) | (1<<GPIO_USB_PU) | (1<<GPIO_LED);
+        PIO_GLITCH_ENABLE = (1<<GPIO_KEY);
+        PIO_OUTPUT_DATA_SET = (1<<GPIO_USB_PU) | (1<<GPIO_LED);
+        PIO_OUTPUT_ENABLE = (1<<GPIO_USB_PU) | (1<<GPIO_LED);
+        BOOT_TIMELINE->stamp[BOOT_STAGE_JUMP_TO_APP] = PIT_IMAGE;
+        CallApp(BOOT_MAILBOX->base);
+    }
+
+    // Copy just the image, rounded up to whole bursts; if the header looks
+    // wrong, everything that it could be.
+    if(RAM_IMAGE_FLASH[2] == 0xB007C0DE && RAM_IMAGE_FLASH[3] != 0 &&
+        RAM_IMAGE_FLASH[3] <= RAM_IMAGE_MAX)
+    {
+        len = (RAM_IMAGE_FLASH[3] + 31) & ~31;
+    } else {
+        len = RAM_IMAGE_MAX;
     }
+    CopyBlocks(RAM_IMAGE_RAM, RAM_IMAGE_FLASH, len);
+    BOOT_TIMELINE->stamp[BOOT_STAGE_RAM_COPY_DONE] = PIT_IMAGE;
 
     CallRam();
 }
@@ -4,13 +4,73 @@
 .code 32
 .align 0
 
+@ This is the start of the RAM image. Once Bootrom() has remapped RAM to
+@ address 0, it is the exception vector table too; only the IRQ vector is
+@ ever taken, so the image header can sit where the other vectors would.
+
 .global start
 start:
-    ldr     sp,     = 0x00203ff8
+    ldr     sp,     = 0x00203f78
     bl      Bootrom
 
+@ The header: tag, size of the image, config word, end marker. The config
+@ word's bit 0 is always_connect (run the bootloader without the key), bit
+@ 1 is validated boot (only start an application that usbdl has vouched
+@ for; see CMD_VALIDATE_IMAGE), bit 2 is fast_start (start the application
+@ on the slow clock, before the PLL is up; see fromflash.c), and bits 15..8
+@ are how many seconds to wait for the downloader (0 for the default of
+@ about 13).
   .word     0xB007C0DE
   .word     __bss_start__-0x00200000
   .word	    0x00000000
   .word	    0xfafffaff
 
+    b       Irq
+Fiq:
+    b       Fiq
+
+@ The IRQ stack sits well below the main stack at 0x00203f78 (above that
+@ is the boot timeline, see usb_cmd.h).
+.equ IRQ_STACK_TOP,     0x00203000
+
+@ Call the handler that the AIC gives us (reading the vector register also
+@ tells the AIC that we have started on it), then signal the end of the
+@ interrupt. The handlers are plain (Thumb) C functions; the AIC hands us
+@ their address with the Thumb bit set, so bx gets the state right.
+Irq:
+    sub     lr,     lr,     #4
+    stmfd   sp!,    {r0-r3, r12, lr}
+    ldr     r0,     = 0xfffff100
+    ldr     r0,     [r0]
+    mov     lr,     pc
+    bx      r0
+    ldr     r0,     = 0xfffff130
+    str     r0,     [r0]
+    ldmfd   sp!,    {r0-r3, r12, pc}^
+
+@ Set up the IRQ mode stack, and let the core take interrupts.
+.global IrqEnable
+.type IrqEnable, %function
+IrqEnable:
+    mrs     r0,     cpsr
+    bic     r1,     r0,     #0x1f
+    orr     r1,     r1,     #0x92
+    msr     cpsr_c, r1
+    ldr     sp,     = IRQ_STACK_TOP
+    bic     r0,     r0,     #0x80
+    msr     cpsr_c, r0
+    bx      lr
+
+.global IrqDisable
+.type IrqDisable, %function
+IrqDisable:
+    mrs     r0,     cpsr
+    orr     r0,     r0,     #0x80
+    msr     cpsr_c, r0
+    bx      lr
+
+@ Start the application whose base is in r0, in ARM state.
+.global CallApp
+.type CallApp, %function
+CallApp:
+    bx      r0
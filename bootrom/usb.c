@@ -1,7 +1,10 @@
 //-----------------------------------------------------------------------------
 // This is a driver for the UDP (USB Device Periphal) on the AT91SAM7{S,X}xxx
 // chips. It appears as a generic HID device; this means that it will work
-// without a kernel-mode driver under most operating systems.
+// without a kernel-mode driver under most operating systems. Alternate
+// setting 1 of the same interface turns the two data endpoints into bulk
+// endpoints, for hosts that can talk to a vendor specific interface (e.g.
+// through libusb); those can move many packets per frame instead of one.
 //
 // This is not very close to USB-compliant, but it is tested and working
 // under Windows XP.
@@ -26,6 +29,17 @@
 
 #define USB_REPORT_PACKET_SIZE 64
 
+// How long UsbStart keeps D+ low before connecting.
+#define USB_DISCONNECT_US 100
+
+// The bits in an endpoint CSR that are cleared by writing a zero, and that
+// are left alone by writing a one.
+#define UDP_CSR_NO_EFFECT_BITS  (UDP_CSR_TX_PACKET_ACKED | \
+                                 UDP_CSR_RX_PACKET_RECEIVED_BANK_0 | \
+                                 UDP_CSR_RX_HAVE_READ_SETUP_DATA | \
+                                 UDP_CSR_STALL_SENT | \
+                                 UDP_CSR_RX_PACKET_RECEIVED_BANK_1)
+
 typedef struct PACKED {
     BYTE        bmRequestType;
     BYTE        bRequest;
@@ -57,6 +71,11 @@ typedef struct PACKED {
 #define USB_DESCRIPTOR_TYPE_HID                 0x21
 #define USB_DESCRIPTOR_TYPE_HID_REPORT          0x22
 
+// bmRequestType bits 5 and 6; anything but zero is a class or vendor request
+#define USB_REQUEST_TYPE_MASK           0x60
+
+#define USB_HID_REQUEST_SET_IDLE        0x0a
+
 #define USB_DEVICE_CLASS_HID                    0x03
 
 // These descriptors are partially adapted from Jan Axelson's sample code,
@@ -105,7 +124,8 @@ static const BYTE DeviceDescriptor[] = {
     0x00,                       // Class code (0)
     0x00,                       // Subclass code (0)
     0x00,                       // Protocol (No specific protocol)
-    0x08,                       // Maximum packet size for Endpoint 0 (8 bytes)
+    0x08,                       // Maximum packet size for Endpoint 0 (8 bytes;
+                                //  that's the size of the UDP's EP0 FIFO)
     0xc5, 0x9a,                 // Vendor ID (random numbers)
     0x8f, 0x4b,                 // Product ID (random numbers)
     0x01, 0x00,                 // Device release number (0001)
@@ -118,7 +138,7 @@ static const BYTE DeviceDescriptor[] = {
 static const BYTE ConfigurationDescriptor[] = {
     0x09,                       // Descriptor length (9 bytes)
     0x02,                       // Descriptor type (Configuration)
-    0x29, 0x00,                 // Total data length (41 bytes)
+    0x40, 0x00,                 // Total data length (64 bytes)
     0x01,                       // Interface supported (1)
     0x01,                       // Configuration value (1)
     0x00,                       // Index of string descriptor (None)
@@ -136,7 +156,7 @@ static const BYTE ConfigurationDescriptor[] = {
     0x00,                       // Protocol code ()
     0x00,                       // Index of string()
 
-    // Class
+    // Class; also returned on its own, see HID_DESCRIPTOR_OFFSET
     0x09,                       // Descriptor length (9 bytes)
     0x21,                       // Descriptor type (HID)
     0x00, 0x01,                 // HID class release number (1.00)
@@ -151,7 +171,7 @@ static const BYTE ConfigurationDescriptor[] = {
     0x05,                       // Descriptor type (Endpoint)
     0x01,                       // Encoded address (Respond to OUT)
     0x03,                       // Endpoint attribute (Interrupt transfer)
-    0x08, 0x00,                 // Maximum packet size (8 bytes)
+    0x40, 0x00,                 // Maximum packet size (64 bytes)
     0x01,                       // Polling interval (1 ms)
 
     // endpoint 2
@@ -159,10 +179,41 @@ static const BYTE ConfigurationDescriptor[] = {
     0x05,                       // Descriptor type (Endpoint)
     0x82,                       // Encoded address (Respond to IN)
     0x03,                       // Endpoint attribute (Interrupt transfer)
-    0x08, 0x00,                 // Maximum packet size (8 bytes)
+    0x40, 0x00,                 // Maximum packet size (64 bytes)
     0x01,                       // Polling interval (1 ms)
+
+    // Interface, alternate setting 1
+    0x09,                       // Descriptor length (9 bytes)
+    0x04,                       // Descriptor type (Interface)
+    0x00,                       // Number of interface (0)
+    0x01,                       // Alternate setting (1)
+    0x02,                       // Number of interface endpoint (2)
+    0xff,                       // Class code (Vendor specific)
+    0x00,                       // Subclass code ()
+    0x00,                       // Protocol code ()
+    0x00,                       // Index of string()
+
+    // endpoint 1
+    0x07,                       // Descriptor length (7 bytes)
+    0x05,                       // Descriptor type (Endpoint)
+    0x01,                       // Encoded address (Respond to OUT)
+    0x02,                       // Endpoint attribute (Bulk transfer)
+    0x40, 0x00,                 // Maximum packet size (64 bytes)
+    0x00,                       // Polling interval (ignored)
+
+    // endpoint 2
+    0x07,                       // Descriptor length (7 bytes)
+    0x05,                       // Descriptor type (Endpoint)
+    0x82,                       // Encoded address (Respond to IN)
+    0x02,                       // Endpoint attribute (Bulk transfer)
+    0x40, 0x00,                 // Maximum packet size (64 bytes)
+    0x00,                       // Polling interval (ignored)
 };
 
+// Where the HID descriptor sits in the configuration descriptor, after the
+// configuration and interface descriptors.
+#define HID_DESCRIPTOR_OFFSET   18
+
 static const BYTE StringDescriptor0[] = {
     0x04,                       // Length
     0x03,                       // Type is string
@@ -208,22 +259,65 @@ static const BYTE * const StringDescriptors[] = {
     StringDescriptor2,
 };
 
-// The buffer used to store packets received over USB while we are in the
-// process of receiving them.
-static BYTE UsbBuffer[64];
+#define STRING_DESCRIPTOR_COUNT \
+    (sizeof(StringDescriptors) / sizeof(StringDescriptors[0]))
+
+// Reports received on EP1. The interrupt handler drains the UDP's banks
+// into this queue as soon as they fill, and UsbPoll hands them on to
+// UsbPacketReceived. UsbRxHead only changes in the interrupt handler and
+// UsbRxTail only in the main loop; the difference between the two is the
+// number of reports waiting.
+#define USB_RX_QUEUE_SIZE 8
+
+typedef struct {
+    int         len;
+    DWORD       arrived;        // PIT_IMAGE when the interrupt handler took it
+    BYTE        data[USB_REPORT_PACKET_SIZE];
+} UsbRxReport;
 
-// The number of characters received in the USB buffer so far.
-static int  UsbSoFarCount;
+static UsbRxReport UsbRxQueue[USB_RX_QUEUE_SIZE];
+static volatile DWORD UsbRxHead;
+static volatile DWORD UsbRxTail;
+
+// The EP1 bank that the UDP fills next. It alternates between bank 0 and
+// bank 1 (starting with bank 0 after an endpoint reset), so this is also
+// the bank that we have to drain next. Only the interrupt handler uses it
+// while the EP1 interrupt is enabled.
+static DWORD UsbRxBank;
+
+// TRUE while the packet last loaded into the EP2 FIFO has not been picked
+// up by the host yet.
+static BOOL UsbTxPending;
+
+// Counters for the EP1 receive path; see USB_STAT_xxx in usb_cmd.h. The
+// interrupt handler updates most of them.
+static DWORD UsbStatistics[USB_STAT_COUNT];
 
 static BYTE CurrentConfiguration;
 
+// 0 for the HID interface, 1 for the bulk one.
+static BYTE CurrentAltSetting;
+
+// PIT_IMAGE when we turned on the D+ pullup, for USB_STAT_ENUM_TIME.
+static DWORD UsbConnectedAt;
+
+// Set by the first bus reset after that; someone is there.
+static BOOL UsbHostSeen;
+
 //-----------------------------------------------------------------------------
-// Send a packet over EP0. This blocks until the packet has been transmitted
-// and an ACK from the host has been received.
+// Send a packet over EP0; at most maxLen bytes of it, which is what the host
+// asked for. This blocks until the packet has been transmitted and an ACK
+// from the host has been received. If we send less than the host asked for
+// and the last packet was a full one, a zero-length packet tells the host
+// that there is no more.
 //-----------------------------------------------------------------------------
-static void UsbSendEp0(const BYTE *data, int len)
+static void UsbSendEp0(const BYTE *data, int len, int maxLen)
 {
     int thisTime, i;
+    BOOL shortReply;
+
+    shortReply = (len < maxLen);
+    len = min(len, maxLen);
 
     do {
         thisTime = min(len, 8);
@@ -250,7 +344,7 @@ static void UsbSendEp0(const BYTE *data, int len)
                 return;
             }
         } while(!(UDP_ENDPOINT_CSR(0) & UDP_CSR_TX_PACKET_ACKED));
-    } while(len > 0);
+    } while(len > 0 || (shortReply && thisTime == 8));
 
     if(UDP_ENDPOINT_CSR(0) & UDP_CSR_TX_PACKET_ACKED) {
         UDP_ENDPOINT_CSR(0) &= ~UDP_CSR_TX_PACKET_ACKED;
@@ -276,6 +370,53 @@ static void UsbSendZeroLength(void)
         ;
 }
 
+//-----------------------------------------------------------------------------
+// Refuse the request in the current SETUP packet. The host sees a STALL
+// for its data or status stage straight away, rather than a NAK until it
+// times out, which costs seconds during enumeration. HandleRxdSetupData
+// lifts the stall when the next SETUP packet comes in.
+//-----------------------------------------------------------------------------
+static void UsbStallEp0(void)
+{
+    UDP_ENDPOINT_CSR(0) |= UDP_CSR_FORCE_STALL;
+    UsbStatistics[USB_STAT_EP0_STALLS]++;
+}
+
+//-----------------------------------------------------------------------------
+// Set up EP1 and EP2 for the current configuration and alternate setting:
+// interrupt endpoints for the HID interface, bulk endpoints otherwise. This
+// also resets their data toggles and bank state.
+//-----------------------------------------------------------------------------
+static void ConfigureDataEndpoints(void)
+{
+    UDP_INTERRUPT_DISABLE = UDP_INTERRUPT_ENDPOINT(1);
+
+    UDP_RESET_ENDPOINT = UDP_RESET_ENDPOINT_NUMBER(1) |
+        UDP_RESET_ENDPOINT_NUMBER(2);
+    UDP_RESET_ENDPOINT = 0;
+
+    UsbRxTail = UsbRxHead;
+    UsbRxBank = UDP_CSR_RX_PACKET_RECEIVED_BANK_0;
+    UsbTxPending = FALSE;
+
+    if(!CurrentConfiguration) {
+        UDP_ENDPOINT_CSR(1) = 0;
+        UDP_ENDPOINT_CSR(2) = 0;
+    } else if(CurrentAltSetting) {
+        UDP_ENDPOINT_CSR(1) = UDP_CSR_ENABLE_EP | UDP_CSR_EPTYPE_BULK_OUT;
+        UDP_ENDPOINT_CSR(2) = UDP_CSR_ENABLE_EP | UDP_CSR_EPTYPE_BULK_IN;
+    } else {
+        UDP_ENDPOINT_CSR(1) = UDP_CSR_ENABLE_EP |
+            UDP_CSR_EPTYPE_INTERRUPT_OUT;
+        UDP_ENDPOINT_CSR(2) = UDP_CSR_ENABLE_EP |
+            UDP_CSR_EPTYPE_INTERRUPT_IN;
+    }
+
+    if(CurrentConfiguration) {
+        UDP_INTERRUPT_ENABLE = UDP_INTERRUPT_ENDPOINT(1);
+    }
+}
+
 //-----------------------------------------------------------------------------
 // Handle a received SETUP DATA packet. These are the packets used to
 // configure the link (e.g. request various descriptors, and assign our
@@ -290,6 +431,11 @@ static void HandleRxdSetupData(void)
         ((BYTE *)&usd)[i] = UDP_ENDPOINT_FIFO(0);
     }
 
+    if(UDP_ENDPOINT_CSR(0) & (UDP_CSR_FORCE_STALL | UDP_CSR_STALL_SENT)) {
+        UDP_ENDPOINT_CSR(0) = (UDP_ENDPOINT_CSR(0) | UDP_CSR_NO_EFFECT_BITS) &
+            ~(UDP_CSR_FORCE_STALL | UDP_CSR_STALL_SENT);
+    }
+
     if(usd.bmRequestType & 0x80) {
         UDP_ENDPOINT_CSR(0) |= UDP_CSR_CONTROL_DATA_DIR;
         while(!(UDP_ENDPOINT_CSR(0) & UDP_CSR_CONTROL_DATA_DIR))
@@ -300,20 +446,43 @@ static void HandleRxdSetupData(void)
     while(UDP_ENDPOINT_CSR(0) & UDP_CSR_RX_HAVE_READ_SETUP_DATA)
         ;
 
+    if(usd.bmRequestType & USB_REQUEST_TYPE_MASK) {
+        // The only class request that we see is the HID SET_IDLE that
+        // Windows sends while it enumerates us; we don't have any input
+        // reports to be idle about, so just agree.
+        if(usd.bRequest == USB_HID_REQUEST_SET_IDLE &&
+            !(usd.bmRequestType & 0x80))
+        {
+            UsbSendZeroLength();
+        } else {
+            UsbStallEp0();
+        }
+        return;
+    }
+
     switch(usd.bRequest) {
         case USB_REQUEST_GET_DESCRIPTOR:
             if((usd.wValue >> 8) == USB_DESCRIPTOR_TYPE_DEVICE) {
                 UsbSendEp0((BYTE *)&DeviceDescriptor,
-                    min(sizeof(DeviceDescriptor), usd.wLength));
+                    sizeof(DeviceDescriptor), usd.wLength);
             } else if((usd.wValue >> 8) == USB_DESCRIPTOR_TYPE_CONFIGURATION) {
                 UsbSendEp0((BYTE *)&ConfigurationDescriptor,
-                    min(sizeof(ConfigurationDescriptor), usd.wLength));
-            } else if((usd.wValue >> 8) == USB_DESCRIPTOR_TYPE_STRING) {
+                    sizeof(ConfigurationDescriptor), usd.wLength);
+            } else if((usd.wValue >> 8) == USB_DESCRIPTOR_TYPE_STRING &&
+                (usd.wValue & 0xff) < STRING_DESCRIPTOR_COUNT)
+            {
                 const BYTE *s = StringDescriptors[usd.wValue & 0xff];
-                UsbSendEp0(s, min(s[0], usd.wLength));
+                UsbSendEp0(s, s[0], usd.wLength);
+            } else if((usd.wValue >> 8) == USB_DESCRIPTOR_TYPE_HID) {
+                const BYTE *h = ConfigurationDescriptor + HID_DESCRIPTOR_OFFSET;
+                UsbSendEp0(h, h[0], usd.wLength);
             } else if((usd.wValue >> 8) == USB_DESCRIPTOR_TYPE_HID_REPORT) {
                 UsbSendEp0((BYTE *)&HidReportDescriptor,
-                    min(sizeof(HidReportDescriptor), usd.wLength));
+                    sizeof(HidReportDescriptor), usd.wLength);
+            } else {
+                // e.g. the device qualifier, or the string 0xEE that
+                // Windows asks for the first time it sees us
+                UsbStallEp0();
             }
             break;
 
@@ -328,74 +497,107 @@ static void HandleRxdSetupData(void)
             break;
 
         case USB_REQUEST_GET_CONFIGURATION:
-            UsbSendEp0(&CurrentConfiguration, sizeof(CurrentConfiguration));
+            UsbSendEp0(&CurrentConfiguration, sizeof(CurrentConfiguration),
+                usd.wLength);
             break;
 
         case USB_REQUEST_GET_STATUS: {
             if(usd.bmRequestType & 0x80) {
                 WORD w = 0;
-                UsbSendEp0((BYTE *)&w, sizeof(w));
+                UsbSendEp0((BYTE *)&w, sizeof(w), usd.wLength);
             }
             break;
         }
         case USB_REQUEST_SET_CONFIGURATION:
             CurrentConfiguration = usd.wValue;
+            CurrentAltSetting = 0;
             if(CurrentConfiguration) {
                 UDP_GLOBAL_STATE = UDP_GLOBAL_STATE_CONFIGURED;
-                UDP_ENDPOINT_CSR(1) = UDP_CSR_ENABLE_EP |
-                    UDP_CSR_EPTYPE_INTERRUPT_OUT;
-                UDP_ENDPOINT_CSR(2) = UDP_CSR_ENABLE_EP |
-                    UDP_CSR_EPTYPE_INTERRUPT_IN;
+                BootMark(BOOT_STAGE_CONFIGURED);
+                if(!UsbStatistics[USB_STAT_ENUM_TIME]) {
+                    UsbStatistics[USB_STAT_ENUM_TIME] =
+                        PIT_IMAGE - UsbConnectedAt;
+                }
             } else {
                 UDP_GLOBAL_STATE = UDP_GLOBAL_STATE_ADDRESSED;
-                UDP_ENDPOINT_CSR(1) = 0;
-                UDP_ENDPOINT_CSR(2) = 0;
             }
+            ConfigureDataEndpoints();
             UsbSendZeroLength();
             break;
 
-        case USB_REQUEST_GET_INTERFACE: {
-            BYTE b = 0;
-            UsbSendEp0(&b, sizeof(b));
+        case USB_REQUEST_GET_INTERFACE:
+            UsbSendEp0(&CurrentAltSetting, sizeof(CurrentAltSetting),
+                usd.wLength);
             break;
-        }
 
         case USB_REQUEST_SET_INTERFACE:
+            if(usd.wValue <= 1) {
+                CurrentAltSetting = usd.wValue;
+                ConfigureDataEndpoints();
+            }
             UsbSendZeroLength();
             break;
-            
+
         case USB_REQUEST_CLEAR_FEATURE:
+            // Nothing of ours is ever halted, or woken remotely.
+            UsbSendZeroLength();
+            break;
+
         case USB_REQUEST_SET_FEATURE:
         case USB_REQUEST_SET_DESCRIPTOR:
         case USB_REQUEST_SYNC_FRAME:
         default:
+            UsbStallEp0();
             break;
     }
 }
 
 //-----------------------------------------------------------------------------
-// Send a data packet. This packet should be exactly USB_REPORT_PACKET_SIZE
-// long. This function blocks until the packet has been transmitted, and
-// an ACK has been received from the host.
+// Returns TRUE if EP2 is free, i.e. UsbSendPacket can load a packet without
+// having to wait for the host to collect the previous one first.
+//-----------------------------------------------------------------------------
+BOOL UsbSendReady(void)
+{
+    if(UsbTxPending && (UDP_ENDPOINT_CSR(2) & UDP_CSR_TX_PACKET_ACKED)) {
+        UDP_ENDPOINT_CSR(2) &= ~UDP_CSR_TX_PACKET_ACKED;
+
+        while(UDP_ENDPOINT_CSR(2) & UDP_CSR_TX_PACKET_ACKED)
+            ;
+        UsbTxPending = FALSE;
+    }
+
+    return !UsbTxPending;
+}
+
+//-----------------------------------------------------------------------------
+// Send a data packet. This packet should be at most USB_REPORT_PACKET_SIZE
+// long, so that it goes out as a single transaction on EP2. On the HID
+// interface a report always has the size from the report descriptor, so
+// shorter packets are padded with zeros; on the bulk interface they go out
+// as they are. This function waits until the host has collected the
+// previous packet, but returns as soon as this one is in the FIFO; use
+// UsbSendReady to find out whether it would have to wait.
 //-----------------------------------------------------------------------------
 void UsbSendPacket(BYTE *packet, int len)
 {
     int i, thisTime;
 
     while(len > 0) {
-        thisTime = min(len, 8);
-       
+        thisTime = min(len, USB_REPORT_PACKET_SIZE);
+
+        while(!UsbSendReady())
+            ;
+
         for(i = 0; i < thisTime; i++) {
             UDP_ENDPOINT_FIFO(2) = packet[i];
         }
+        if(!CurrentAltSetting) {
+            for(; i < USB_REPORT_PACKET_SIZE; i++) {
+                UDP_ENDPOINT_FIFO(2) = 0;
+            }
+        }
         UDP_ENDPOINT_CSR(2) |= UDP_CSR_TX_PACKET;
-
-        while(!(UDP_ENDPOINT_CSR(2) & UDP_CSR_TX_PACKET_ACKED))
-            ;
-        UDP_ENDPOINT_CSR(2) &= ~UDP_CSR_TX_PACKET_ACKED;
-
-        while(UDP_ENDPOINT_CSR(2) & UDP_CSR_TX_PACKET_ACKED)
-            ;
+        UsbTxPending = TRUE;
 
         len -= thisTime;
         packet += thisTime;
@@ -403,47 +605,134 @@ void UsbSendPacket(BYTE *packet, int len)
 }
 
 //-----------------------------------------------------------------------------
-// Handle a received packet. This handles only those packets received on
-// EP1 (i.e. the HID reports that we use as our data packets).
+// Read the packet waiting in the current EP1 bank into r, and give the bank
+// back to the UDP straight away, so that the host can fill it again while
+// we are still busy with the report. With 64 byte endpoints a whole report
+// arrives in a single transaction.
+//
+// We don't wait for the bank flag to actually clear; the next bank we look
+// at is the other one, and the write has long since gone through by the
+// time we come back to this one.
 //-----------------------------------------------------------------------------
-static void HandleRxdData(void)
+static void ReadRxdBank(UsbRxReport *r)
 {
     int i, len;
+    DWORD bank = UsbRxBank;
 
-    if(UDP_ENDPOINT_CSR(1) & UDP_CSR_RX_PACKET_RECEIVED_BANK_0) {
-        len = UDP_CSR_BYTES_RECEIVED(UDP_ENDPOINT_CSR(1));
+    r->arrived = PIT_IMAGE;
 
-        for(i = 0; i < len; i++) {
-            UsbBuffer[UsbSoFarCount] = UDP_ENDPOINT_FIFO(1);
-            UsbSoFarCount++;
-        }
+    len = UDP_CSR_BYTES_RECEIVED(UDP_ENDPOINT_CSR(1));
+    if(len > USB_REPORT_PACKET_SIZE) {
+        len = USB_REPORT_PACKET_SIZE;
+    }
+    for(i = 0; i < len; i++) {
+        r->data[i] = UDP_ENDPOINT_FIFO(1);
+    }
+    r->len = len;
 
-        UDP_ENDPOINT_CSR(1) &= ~UDP_CSR_RX_PACKET_RECEIVED_BANK_0;
-        while(UDP_ENDPOINT_CSR(1) & UDP_CSR_RX_PACKET_RECEIVED_BANK_0)
-            ;
+    UDP_ENDPOINT_CSR(1) = (UDP_ENDPOINT_CSR(1) | UDP_CSR_NO_EFFECT_BITS) & ~bank;
 
-        if(UsbSoFarCount >= 64) {
-            UsbPacketReceived(UsbBuffer, UsbSoFarCount);
-            UsbSoFarCount = 0;
-        }
+    UsbRxBank ^= UDP_CSR_RX_PACKET_RECEIVED_BANK_0 |
+        UDP_CSR_RX_PACKET_RECEIVED_BANK_1;
+
+    UsbStatistics[USB_STAT_RX_PACKETS]++;
+    if(UDP_ENDPOINT_CSR(1) & UsbRxBank) {
+        // The host already got its next report into the other bank; with
+        // a single bank it would have been NAKed until now.
+        UsbStatistics[USB_STAT_RX_NAKS_AVOIDED]++;
     }
+}
+
+//-----------------------------------------------------------------------------
+// The UDP interrupt handler, called through the AIC. EP1 is the only source
+// that we enable: drain the banks that the UDP has filled into the queue,
+// in the order in which it filled them. If the queue is full, then the rest
+// stays in the UDP, which NAKs the host, and we stop listening to EP1 until
+// UsbPoll has made room.
+//
+// The end of bus reset interrupt can't be masked in the UDP; if that (or
+// anything else that we don't handle here) is pending, mask the UDP in the
+// AIC instead, and leave it to UsbPoll.
+//-----------------------------------------------------------------------------
+#define UDP_OTHER_INTERRUPTS() (UDP_INTERRUPT_STATUS & \
+    (UDP_INTERRUPT_MASK | UDP_INTERRUPT_END_OF_BUS_RESET) & \
+    ~UDP_INTERRUPT_ENDPOINT(1))
+
+void UsbIrqHandler(void)
+{
+    DWORD queued;
 
-    if(UDP_ENDPOINT_CSR(1) & UDP_CSR_RX_PACKET_RECEIVED_BANK_1) {
-        len = UDP_CSR_BYTES_RECEIVED(UDP_ENDPOINT_CSR(1));
+    if(UDP_OTHER_INTERRUPTS()) {
+        AIC_INTERRUPT_DISABLE = (1 << PERIPH_UDP);
+        return;
+    }
 
-        for(i = 0; i < len; i++) {
-            UsbBuffer[UsbSoFarCount] = UDP_ENDPOINT_FIFO(1);
-            UsbSoFarCount++;
+    while(UDP_ENDPOINT_CSR(1) & UsbRxBank) {
+        queued = UsbRxHead - UsbRxTail;
+        if(queued >= USB_RX_QUEUE_SIZE) {
+            UsbStatistics[USB_STAT_RX_QUEUE_FULL]++;
+            UDP_INTERRUPT_DISABLE = UDP_INTERRUPT_ENDPOINT(1);
+            break;
         }
+        ReadRxdBank(&UsbRxQueue[UsbRxHead % USB_RX_QUEUE_SIZE]);
+        UsbRxHead++;
 
-        UDP_ENDPOINT_CSR(1) &= ~UDP_CSR_RX_PACKET_RECEIVED_BANK_1;
-        while(UDP_ENDPOINT_CSR(1) & UDP_CSR_RX_PACKET_RECEIVED_BANK_1)
-            ;
+        if(queued + 1 > UsbStatistics[USB_STAT_RX_MAX_QUEUED]) {
+            UsbStatistics[USB_STAT_RX_MAX_QUEUED] = queued + 1;
+        }
+    }
+}
+
+//-----------------------------------------------------------------------------
+// Hand the reports that the interrupt handler has queued to
+// UsbPacketReceived, as long as the code that uses us can take them.
+// Returns TRUE if there were any.
+//-----------------------------------------------------------------------------
+static BOOL HandleRxdData(void)
+{
+    BOOL ret = FALSE;
+    UsbRxReport *r;
+    DWORD latency;
+
+    while(UsbRxTail != UsbRxHead && UsbReadyToReceive()) {
+        r = &UsbRxQueue[UsbRxTail % USB_RX_QUEUE_SIZE];
 
-        if(UsbSoFarCount >= 64) {
-            UsbPacketReceived(UsbBuffer, UsbSoFarCount);
-            UsbSoFarCount = 0;
+        latency = PIT_IMAGE - r->arrived;
+        if(latency > UsbStatistics[USB_STAT_RX_MAX_LATENCY]) {
+            UsbStatistics[USB_STAT_RX_MAX_LATENCY] = latency;
         }
+
+        UsbPacketReceived(r->data, r->len);
+        UsbRxTail++;
+        ret = TRUE;
+    }
+
+    if(CurrentConfiguration && UsbRxHead - UsbRxTail < USB_RX_QUEUE_SIZE) {
+        // there is room in the queue (again)
+        UDP_INTERRUPT_ENABLE = UDP_INTERRUPT_ENDPOINT(1);
+    }
+
+    return ret;
+}
+
+//-----------------------------------------------------------------------------
+// Returns TRUE once a host has reset the bus since UsbStart; a hub or root
+// port does that within a few hundred ms of seeing our pullup.
+//-----------------------------------------------------------------------------
+BOOL UsbHostPresent(void)
+{
+    return UsbHostSeen;
+}
+
+//-----------------------------------------------------------------------------
+// Copy the driver's counters (USB_STAT_COUNT of them) to stats.
+//-----------------------------------------------------------------------------
+void UsbGetStatistics(DWORD *stats)
+{
+    int i;
+
+    for(i = 0; i < USB_STAT_COUNT; i++) {
+        stats[i] = UsbStatistics[i];
     }
 }
 
@@ -457,16 +746,39 @@ void UsbStart(void)
 {
     volatile int i;
 
-    UsbSoFarCount = 0;
+    UsbRxHead = 0;
+    UsbRxTail = 0;
+    UsbRxBank = UDP_CSR_RX_PACKET_RECEIVED_BANK_0;
+    UsbTxPending = FALSE;
+    for(i = 0; i < USB_STAT_COUNT; i++) {
+        UsbStatistics[i] = 0;
+    }
 
-	// take care the optimizer does not remove it!
-    for(i = 0; i < 1000000; i++) USB_D_PLUS_PULLUP_OFF();
+    // Make sure that the host sees us go away, in case we were connected
+    // before (e.g. as the application). A hub takes 2.5 us of SE0 as a
+    // disconnect; the rest is for D+ to fall through the host's pulldown.
+    USB_D_PLUS_PULLUP_OFF();
+    DelayUs(USB_DISCONNECT_US);
 
     USB_D_PLUS_PULLUP_ON();
+    UsbConnectedAt = PIT_IMAGE;
+    UsbHostSeen = FALSE;
+    BootMark(BOOT_STAGE_PULLUP_ON);
 
     if(UDP_INTERRUPT_STATUS & UDP_INTERRUPT_END_OF_BUS_RESET) {
         UDP_INTERRUPT_CLEAR = UDP_INTERRUPT_END_OF_BUS_RESET;
     }
+
+    // EP1 is interrupt driven; see UsbIrqHandler. Everything else is
+    // polled, so it stays masked in the UDP; the EP1 interrupt itself is
+    // off after reset, and ConfigureDataEndpoints enables it once the host
+    // has configured us.
+    UDP_INTERRUPT_DISABLE = ~UDP_INTERRUPT_ENDPOINT(1);
+    AIC_INTERRUPT_DISABLE = (1 << PERIPH_UDP);
+    AIC_SOURCE_MODE(PERIPH_UDP) = AIC_SOURCE_MODE_LEVEL_SENSITIVE |
+        AIC_SOURCE_MODE_PRIORITY(4);
+    AIC_SOURCE_VECTOR(PERIPH_UDP) = (DWORD)UsbIrqHandler;
+    AIC_INTERRUPT_ENABLE = (1 << PERIPH_UDP);
 }
 
 //-----------------------------------------------------------------------------
@@ -483,8 +795,11 @@ BOOL UsbPoll(void)
 
     if(UDP_INTERRUPT_STATUS & UDP_INTERRUPT_END_OF_BUS_RESET) {
         UDP_INTERRUPT_CLEAR = UDP_INTERRUPT_END_OF_BUS_RESET;
+        UsbHostSeen = TRUE;
+        BootMark(BOOT_STAGE_BUS_RESET);
 
         // following a reset we should be ready to receive a setup packet
+        UDP_INTERRUPT_DISABLE = UDP_INTERRUPT_ENDPOINT(1);
         UDP_RESET_ENDPOINT = 0xf;
         UDP_RESET_ENDPOINT = 0;
 
@@ -493,6 +808,10 @@ BOOL UsbPoll(void)
         UDP_ENDPOINT_CSR(0) = UDP_CSR_EPTYPE_CONTROL | UDP_CSR_ENABLE_EP;
 
         CurrentConfiguration = 0;
+        CurrentAltSetting = 0;
+        UsbRxTail = UsbRxHead;
+        UsbRxBank = UDP_CSR_RX_PACKET_RECEIVED_BANK_0;
+        UsbTxPending = FALSE;
 
         ret = TRUE;
     }
@@ -504,10 +823,20 @@ BOOL UsbPoll(void)
         }
     }
 
-    if(UDP_INTERRUPT_STATUS & UDP_INTERRUPT_ENDPOINT(1)) {
-        HandleRxdData();
+    if(HandleRxdData()) {
         ret = TRUE;
     }
 
+    // We don't act on suspend, resume or SOF, but they are set anyway;
+    // acknowledge them, so that they don't keep the interrupt handler off.
+    UDP_INTERRUPT_CLEAR = UDP_INTERRUPT_SUSPEND | UDP_INTERRUPT_RESUME |
+        UDP_INTERRUPT_EXTERNAL_RESUME | UDP_INTERRUPT_SOF |
+        UDP_INTERRUPT_WAKEUP;
+
+    if(!UDP_OTHER_INTERRUPTS()) {
+        // nothing left that would make the interrupt handler give up
+        AIC_INTERRUPT_ENABLE = (1 << PERIPH_UDP);
+    }
+
     return ret;
 }
@@ -18,7 +18,16 @@ typedef struct {
     } d;
 } UsbCommand;
 
-#define CMD_VERSION 0x00010002
+// The short reply that the device sends for every page written with
+// CMD_WRITE_PAGES, once the page is in flash.
+typedef struct {
+    DWORD       cmd;            // CMD_PAGE_STATUS, with the page's sequence number
+    DWORD       addr;           // the address of the page
+    DWORD       crc;            // CRC32 of the page, as read back from flash
+    DWORD       status;         // flash controller error bits, 0 if OK
+} UsbPageStatus;
+
+#define CMD_VERSION 0x00010010
 
 // For the bootloader
 #define CMD_DEVICE_INFO                         0x0000
@@ -26,6 +35,189 @@ typedef struct {
 #define CMD_FINISH_WRITE                        0x0003
 #define CMD_HARDWARE_RESET                      0x0004
 #define CMD_CRC32_MEMORY                        0x0005
+#define CMD_USB_STATISTICS                      0x0006
+#define CMD_WRITE_PAGES                         0x0007
+#define CMD_CRC32_PAGES                         0x0008
+#define CMD_WRITE_COMPRESSED                    0x0009
+#define CMD_FILL_PAGES                          0x000a
+#define CMD_BOOT_TIMELINE                       0x000b
+#define CMD_VALIDATE_IMAGE                      0x000c
+#define CMD_BOOT_SLOTS                          0x000d
+#define CMD_PAGE_STATUS                         0x00fe
 #define CMD_ACK                                 0x00ff
 
+// The command code lives in the lower half of cmd. The upper half is a
+// sequence number chosen by the host, which the device copies into its
+// reply, so that a host with several commands on the way can tell which
+// one an answer belongs to. Older hosts always send zero there.
+#define CMD_CODE(x)                             ((x) & 0xffff)
+#define CMD_SEQ(x)                              (((x) >> 16) & 0xffff)
+#define CMD_WITH_SEQ(code, seq)                 (((DWORD)(seq) << 16) | (code))
+
+// The counters returned in d.asDwords[] by CMD_USB_STATISTICS
+#define USB_STAT_RX_PACKETS                     0   // reports received on EP1
+#define USB_STAT_RX_NAKS_AVOIDED                1   // ... while the other bank was full
+#define USB_STAT_RX_QUEUE_FULL                  2   // times the receive queue was full
+#define USB_STAT_RX_MAX_QUEUED                  3   // most reports ever waiting at once
+#define USB_STAT_RX_MAX_LATENCY                 4   // worst time from the EP1 interrupt to
+                                                    // UsbPacketReceived, in MCK/16 ticks
+#define USB_STAT_ENUM_TIME                      5   // D+ pullup on to SET_CONFIGURATION,
+                                                    // in MCK/16 ticks
+#define USB_STAT_EP0_STALLS                     6   // control requests refused
+#define USB_STAT_COUNT                          7
+
+// CMD_WRITE_PAGES writes ext2 pages starting at address ext1. It is not
+// ACKed; the header is followed by the raw page data, FLASH_PAGE_SIZE/64
+// reports per page without any UsbCommand header, and the device answers
+// every page with a UsbPageStatus. The pages get consecutive sequence
+// numbers, starting with the one in the header.
+//
+// The host does not have to wait for a page's status before it sends the
+// next page. The device buffers up to the number of pages returned in
+// d.asDwords[0] of the CMD_DEVICE_INFO reply and NAKs further data while
+// that buffer is full, so the host may have that many pages outstanding
+// (sent, but no status read yet), and no more.
+
+// CMD_CRC32_MEMORY returns the CRC32 of ext2 bytes at address ext1 in ext1,
+// and (from version 0x00010007 on) the time that took, in MCK cycles with
+// a resolution of 16, in ext2. Bit 0 of ext3 selects the old bit-serial
+// loop instead of the table driven one, to compare the two.
+#define CRC32_MEMORY_BITWISE                    0x00000001
+
+// CMD_CRC32_PAGES returns in d.asDwords[] the CRC32 of each of ext2 pages
+// (at most CRC32_PAGES_MAX) starting at address ext1.
+#define CRC32_PAGES_MAX                         12
+
+// CMD_WRITE_COMPRESSED works like CMD_WRITE_PAGES (ext1 = address, ext2 =
+// page count, no ACK, a UsbPageStatus per page, the same window), but the
+// reports that follow carry the pages LZ compressed; ext3 is the length of
+// the compressed data, and the last report is padded with zeros. The
+// format is LZSS: a flag byte says what the next eight items are, from bit
+// 0 up; 0 is a literal byte, 1 is a match of two bytes,
+//
+//      (dist-1) & 0xff,  ((dist-1) >> 8) | ((len-LZ_MIN_MATCH) << 2)
+//
+// which copies len bytes starting dist bytes back in the output. The
+// window restarts with every CMD_WRITE_COMPRESSED.
+#define LZ_WINDOW_SIZE                          1024
+#define LZ_MIN_MATCH                            3
+#define LZ_MAX_MATCH                            66
+
+// CMD_FILL_PAGES writes ext2 pages starting at address ext1 with every
+// word set to ext3 (0xffffffff for erased looking pages). No data follows;
+// like CMD_WRITE_PAGES it is not ACKed, and every page gets a UsbPageStatus.
+
+// The boot timeline: when each stage of the boot was reached, as PIT_IMAGE
+// values (the PIT starts counting at reset). Until the first stage
+// switches MCK over to the PLL, at PIT_IMAGE = pll, the PIT counts the slow
+// clock divided by 16, about 488 us per tick; after that it counts MCK/16,
+// three ticks to the microsecond. A stage that wasn't reached (yet) is
+// BOOT_STAMP_NONE.
+//
+// The record lives at BOOT_TIMELINE_ADDR, above the bootloader's stack,
+// and stays there when the application starts, so that the application
+// can log it too. CMD_BOOT_TIMELINE returns the stage count in ext1, pll in
+// ext2 and the stamps in d.asDwords[]; ext3 is the PMC's MAINF, the number
+// of main clock (18.432 MHz) cycles in 16 slow clock cycles, to work out
+// the actual slow clock frequency.
+#define BOOT_STAGE_RESET                        0
+#define BOOT_STAGE_OSCILLATOR_UP                1
+#define BOOT_STAGE_PLL_LOCKED                   2
+#define BOOT_STAGE_RAM_COPY_DONE                3
+#define BOOT_STAGE_PULLUP_ON                    4
+#define BOOT_STAGE_BUS_RESET                    5
+#define BOOT_STAGE_CONFIGURED                   6
+#define BOOT_STAGE_FIRST_COMMAND                7
+#define BOOT_STAGE_JUMP_TO_APP                  8
+#define BOOT_STAGE_COUNT                        9
+
+#define BOOT_STAMP_NONE                         0xffffffff
+
+#define BOOT_TIMELINE_ADDR                      0x00203f80
+#define BOOT_TIMELINE_MAGIC                     0x7131e11e
+
+typedef struct {
+    DWORD       magic;          // BOOT_TIMELINE_MAGIC
+    DWORD       pll;            // PIT_IMAGE when MCK went to the PLL
+    DWORD       stamp[BOOT_STAGE_COUNT];
+} BootTimeline;
+
+// The application slots: flash can hold more than one application, each
+// linked for its own base address (a multiple of 0x2000, from 0x102000 on).
+// The slot table sits in the boot record, in the flash page below 0x102000,
+// with the slot that starts by default; it takes a single page write to
+// switch to another, so a power cut leaves either the old choice or the new.
+// With no slot table, there is just the one application at 0x102000.
+#define BOOT_SLOT_COUNT                         4
+
+// CMD_VALIDATE_IMAGE vouches for the application that was just written:
+// ext1 bytes from ext3 (0x102000 if zero, as older hosts send), with CRC32
+// ext2. If the application's tag is there and the CRC of the flash
+// matches, the device enters the image in the slot table, which lets a
+// bootrom built with validated boot start it without computing its CRC
+// again; writing any page of a slot drops it from the table, and so does
+// validating another image that overlaps it. The reply has the CRC of the
+// flash in ext1 and VALIDATE_xxx in ext2.
+#define VALIDATE_OK                             0
+#define VALIDATE_NO_TAG                         1
+#define VALIDATE_CRC_MISMATCH                   2
+#define VALIDATE_FLASH_ERROR                    3
+#define VALIDATE_NO_SLOT                        4   // bad base, or the table is full
+
+// CMD_BOOT_SLOTS makes the slot at base ext1 the one that starts by default
+// (ext1 = 0 leaves it alone). The reply has the default slot's index in
+// ext1, SLOTS_xxx in ext2, the base of the slot that was picked for this
+// boot in ext3, and base, size and CRC32 of each slot in d.asDwords[]
+// (zero base for an empty slot, zero size for one that isn't validated).
+#define SLOTS_OK                                0
+#define SLOTS_UNKNOWN                           1   // no slot at that base
+#define SLOTS_FLASH_ERROR                       2
+
+// CMD_HARDWARE_RESET ends the session: once its ACK is out, the device
+// starts the application (ext1 = HARDWARE_RESET_START), or resets itself
+// (ext1 = HARDWARE_RESET_REBOOT), which runs a bootrom that was just
+// written. Before version 0x00010010 it did nothing, except after a
+// BOOT_REQUEST_DOWNLOAD. The reply has HARDWARE_RESET_NO_APP in ext1 if
+// there is no application that the bootloader may start (see
+// CMD_VALIDATE_IMAGE); the device stays in download mode then.
+#define HARDWARE_RESET_START                    0
+#define HARDWARE_RESET_REBOOT                   1
+
+#define HARDWARE_RESET_OK                       0
+#define HARDWARE_RESET_NO_APP                   1
+
+// The boot mailbox, in RAM above the boot timeline, for an application to
+// tell the bootloader what to do at the next boot: it writes the request
+// and its argument, then BOOT_MAILBOX_MAGIC, and enters the bootrom again,
+// either through a reset that keeps RAM (RSTC_CONTROL with PROCRST and
+// PERRST), or by jumping to BOOT_ENTRY_ADDR in ARM state, in a privileged
+// mode with interrupts off and RAM not remapped to 0 (clocks may be left
+// running). The bootloader takes the request out again.
+//
+// The first stage writes the base of the slot that it picks into base,
+// where the second stage looks for it; once the application runs, nothing
+// reads it any more. The flash exception vectors always lead to the first
+// slot (see flash-reset.s).
+#define BOOT_MAILBOX_ADDR                       0x00203fb0
+#define BOOT_MAILBOX_MAGIC                      0x5107b0a7
+#define BOOT_ENTRY_ADDR                         0x00100000
+
+// Start slot arg, for this boot only.
+#define BOOT_REQUEST_SLOT                       1
+// Go straight to download mode, without looking at the key; arg is how
+// many seconds to wait for the host, 0 for as long as it takes. The
+// bootloader doesn't time out once the host is there, but waits for the
+// host's CMD_HARDWARE_RESET. The reply to
+// CMD_DEVICE_INFO has BOOT_ENTRY_WARM in d.asDwords[1] after this request.
+#define BOOT_REQUEST_DOWNLOAD                   2
+
+#define BOOT_ENTRY_WARM                         0x00000001
+
+typedef struct {
+    DWORD       magic;          // BOOT_MAILBOX_MAGIC if there is a request
+    DWORD       request;        // BOOT_REQUEST_xxx
+    DWORD       arg;            // and its argument
+    DWORD       base;           // the slot that is running
+} BootMailbox;
+
 #endif
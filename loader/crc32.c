@@ -0,0 +1,268 @@
+//-----------------------------------------------------------------------------
+// CRC32 for the downloader. There are three implementations of the same
+// function:
+//
+//  - crc32_bitwise, the original loop, one bit at a time; kept as the
+//    reference, and for the benchmark.
+//  - crc32_slice8, eight bytes per step with eight 256-entry tables.
+//  - crc32_pclmul, which folds 64 bytes per step with the carry-less
+//    multiply instruction of newer x86 CPUs, following Intel's "Fast CRC
+//    Computation for Generic Polynomials Using PCLMULQDQ Instruction".
+//
+// crc32_update decides which one to use the first time it is called.
+//-----------------------------------------------------------------------------
+
+#include "crc32.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_PCLMUL_CODE
+#include <immintrin.h>
+#endif
+
+#define CRC32_POLY 0xEDB88320
+
+uint32_t crc32_bitwise(uint32_t crc, const void *data, size_t length)
+{
+    const unsigned char *p = (const unsigned char *)data;
+    size_t i;
+    int j;
+
+    crc = ~crc;
+    for (i = 0; i < length; ++i) {
+        crc = crc ^ p[i];
+
+        for (j = 7; j >= 0; j--) {    // Do eight times.
+            uint32_t mask = -(crc & 1);
+            crc = (crc >> 1) ^ (CRC32_POLY & mask);
+        }
+    }
+
+    return ~crc;
+}
+
+//-----------------------------------------------------------------------------
+// Slice-by-8. Table[0] is the usual byte-at-a-time table; Table[k][b] is the
+// CRC of byte b followed by k zero bytes, so eight table lookups take care
+// of eight bytes at once.
+//-----------------------------------------------------------------------------
+static uint32_t Table[8][256];
+static int TableReady = 0;
+
+static void MakeTables(void)
+{
+    uint32_t c;
+    int i, j;
+
+    for (i = 0; i < 256; i++) {
+        c = i;
+        for (j = 0; j < 8; j++) {
+            c = (c & 1) ? (c >> 1) ^ CRC32_POLY : (c >> 1);
+        }
+        Table[0][i] = c;
+    }
+    for (i = 0; i < 256; i++) {
+        c = Table[0][i];
+        for (j = 1; j < 8; j++) {
+            c = Table[0][c & 0xff] ^ (c >> 8);
+            Table[j][i] = c;
+        }
+    }
+    TableReady = 1;
+}
+
+static uint32_t Load32(const unsigned char *p)
+{
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) |
+        ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+uint32_t crc32_slice8(uint32_t crc, const void *data, size_t length)
+{
+    const unsigned char *p = (const unsigned char *)data;
+
+    if (!TableReady)
+        MakeTables();
+
+    crc = ~crc;
+    while (length >= 8) {
+        uint32_t one = Load32(p) ^ crc;
+        uint32_t two = Load32(p + 4);
+        crc = Table[7][one & 0xff] ^
+              Table[6][(one >> 8) & 0xff] ^
+              Table[5][(one >> 16) & 0xff] ^
+              Table[4][one >> 24] ^
+              Table[3][two & 0xff] ^
+              Table[2][(two >> 8) & 0xff] ^
+              Table[1][(two >> 16) & 0xff] ^
+              Table[0][two >> 24];
+        p += 8;
+        length -= 8;
+    }
+    while (length > 0) {
+        crc = Table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+        length--;
+    }
+
+    return ~crc;
+}
+
+#ifdef HAVE_PCLMUL_CODE
+//-----------------------------------------------------------------------------
+// The folding loop proper. length must be at least 64 and a multiple of 16;
+// crc is the raw (inverted) CRC register, and so is the result. The
+// constants are x^n mod P for the bit-reflected polynomial, from the end of
+// the paper.
+//-----------------------------------------------------------------------------
+__attribute__((target("pclmul,sse4.1")))
+static uint32_t FoldPclmul(uint32_t crc, const unsigned char *p, size_t length)
+{
+    static const uint64_t k1k2[2] __attribute__((aligned(16))) =
+        { 0x0154442bd4ULL, 0x01c6e41596ULL };
+    static const uint64_t k3k4[2] __attribute__((aligned(16))) =
+        { 0x01751997d0ULL, 0x00ccaa009eULL };
+    static const uint64_t k5k0[2] __attribute__((aligned(16))) =
+        { 0x0163cd6124ULL, 0x0000000000ULL };
+    static const uint64_t poly[2] __attribute__((aligned(16))) =
+        { 0x01db710641ULL, 0x01f7011641ULL };
+
+    __m128i x0, x1, x2, x3, x4, x5, x6, x7, x8;
+
+    x1 = _mm_loadu_si128((const __m128i *)(p + 0x00));
+    x2 = _mm_loadu_si128((const __m128i *)(p + 0x10));
+    x3 = _mm_loadu_si128((const __m128i *)(p + 0x20));
+    x4 = _mm_loadu_si128((const __m128i *)(p + 0x30));
+    x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(crc));
+    p += 64;
+    length -= 64;
+
+    // Fold four 128 bit lanes at a time, 64 bytes per step.
+    x0 = _mm_load_si128((const __m128i *)k1k2);
+    while (length >= 64) {
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+        x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+        x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+        x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+        x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x5),
+            _mm_loadu_si128((const __m128i *)(p + 0x00)));
+        x2 = _mm_xor_si128(_mm_xor_si128(x2, x6),
+            _mm_loadu_si128((const __m128i *)(p + 0x10)));
+        x3 = _mm_xor_si128(_mm_xor_si128(x3, x7),
+            _mm_loadu_si128((const __m128i *)(p + 0x20)));
+        x4 = _mm_xor_si128(_mm_xor_si128(x4, x8),
+            _mm_loadu_si128((const __m128i *)(p + 0x30)));
+
+        p += 64;
+        length -= 64;
+    }
+
+    // Fold the four lanes into one.
+    x0 = _mm_load_si128((const __m128i *)k3k4);
+
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+    // Then whatever 16 byte blocks are left.
+    while (length >= 16) {
+        x2 = _mm_loadu_si128((const __m128i *)p);
+
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+
+        p += 16;
+        length -= 16;
+    }
+
+    // 128 bits down to 64.
+    x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+    x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+    x1 = _mm_srli_si128(x1, 8);
+    x1 = _mm_xor_si128(x1, x2);
+
+    x0 = _mm_loadl_epi64((const __m128i *)k5k0);
+
+    x2 = _mm_srli_si128(x1, 4);
+    x1 = _mm_and_si128(x1, x3);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    // Barrett reduction down to 32.
+    x0 = _mm_load_si128((const __m128i *)poly);
+
+    x2 = _mm_and_si128(x1, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+    x2 = _mm_and_si128(x2, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    return _mm_extract_epi32(x1, 1);
+}
+#endif
+
+int crc32_have_pclmul(void)
+{
+#ifdef HAVE_PCLMUL_CODE
+    static int have = -1;
+
+    if (have < 0) {
+        __builtin_cpu_init();
+        have = __builtin_cpu_supports("pclmul") &&
+               __builtin_cpu_supports("sse4.1");
+    }
+    return have;
+#else
+    return 0;
+#endif
+}
+
+uint32_t crc32_pclmul(uint32_t crc, const void *data, size_t length)
+{
+#ifdef HAVE_PCLMUL_CODE
+    const unsigned char *p = (const unsigned char *)data;
+
+    if (length >= 64 && crc32_have_pclmul()) {
+        size_t n = length & ~(size_t)15;
+
+        crc = ~FoldPclmul(~crc, p, n);
+        p += n;
+        length -= n;
+    }
+    return crc32_slice8(crc, p, length);
+#else
+    return crc32_slice8(crc, data, length);
+#endif
+}
+
+uint32_t crc32_update(uint32_t crc, const void *data, size_t length)
+{
+    if (crc32_have_pclmul())
+        return crc32_pclmul(crc, data, length);
+    return crc32_slice8(crc, data, length);
+}
+
+void crc32_init(void)
+{
+    if (!TableReady)
+        MakeTables();
+    crc32_have_pclmul();
+}
+
+uint32_t crc32(const void *data, size_t length)
+{
+    return crc32_update(0, data, length);
+}
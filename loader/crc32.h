@@ -0,0 +1,30 @@
+//-----------------------------------------------------------------------------
+// CRC32 as used by zlib (and by the bootrom): polynomial 0xEDB88320,
+// reflected, with the initial and final inversion. crc32_update works like
+// zlib's crc32(): start with 0 and feed it the data in as many pieces as you
+// like; it picks the fastest implementation that the CPU can run.
+//-----------------------------------------------------------------------------
+
+#ifndef __CRC32_H
+#define __CRC32_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+uint32_t crc32_update(uint32_t crc, const void *data, size_t length);
+uint32_t crc32(const void *data, size_t length);
+
+// Build the tables and look at the CPU now, rather than on first use; a
+// program that calls the functions here from several threads has to call
+// this before it starts them.
+void crc32_init(void);
+
+// The implementations behind crc32_update, so that they can be compared.
+// crc32_pclmul falls back to crc32_slice8 on a CPU without PCLMULQDQ, in
+// which case crc32_have_pclmul returns 0.
+uint32_t crc32_bitwise(uint32_t crc, const void *data, size_t length);
+uint32_t crc32_slice8(uint32_t crc, const void *data, size_t length);
+uint32_t crc32_pclmul(uint32_t crc, const void *data, size_t length);
+int crc32_have_pclmul(void);
+
+#endif
@@ -32,9 +32,12 @@
 #include <stdio.h>
 #include <ctype.h>
 #include <stdlib.h>
+#include <setjmp.h>
+#include <stdarg.h>
 
 
 #include "../include/usb_cmd.h"
+#include "crc32.h"
 
 // This must obviously agree with the descriptors in the ARM-side code.
 #define OUR_VID             0x9ac5
@@ -42,16 +45,144 @@
 
 // Check your datasheets! This varies depending on the part.
 #define FLASH_PAGE_SIZE     256
+#define FLASH_SIZE          (256*1024)
 
-static HANDLE UsbHandle;
-static DWORD VerifyTransfers = 0;
+// Everything that belongs to the device we talk to. With several boards
+// (see LoadBoards) each one has a thread, and with it a copy of all this.
+#define PER_BOARD           __thread
+
+static PER_BOARD HANDLE UsbHandle;
+static PER_BOARD DWORD VerifyTransfers = 0;
+
+// As reported by CMD_DEVICE_INFO; 0 for bootloaders that are too old to
+// answer it. Newer commands are only sent if this is recent enough.
+static PER_BOARD uint32_t BootloaderVersion = 0;
+
+// How many CMD_WRITE_PAGES pages we may have on the way to the device before
+// we wait for a status: what the device can buffer, capped by --window=N.
+static PER_BOARD DWORD DeviceWindow = 1;
+static DWORD Window = 0;
+
+// The sequence number for the next command, with bootloaders that have them.
+static PER_BOARD DWORD SeqCounter = 0;
+
+// Write every page of the image, even the ones that the device already has.
+static BOOL ForceWrite = FALSE;
+
+// Send the pages as they are, even if the bootloader could decompress them.
+static BOOL NoCompress = FALSE;
+
+// Make the application that was just loaded the one that starts by default.
+static BOOL Activate = FALSE;
+
+// Wait for a device for as long as it takes, not just CONNECT_TIMEOUT_MS.
+static BOOL WaitForever = FALSE;
+#define CONNECT_TIMEOUT_MS  250000
+
+// Load every board that is connected (--all), or the ones at the given bus
+// and port paths (--port=1-1.2, as many as needed), all at the same time.
+// With --all we take every board that turns up until none has for
+// ALL_SETTLE_MS; the --port ones get CONNECT_TIMEOUT_MS (or --wait).
+#define MAX_BOARDS          32
+#define ALL_SETTLE_MS       2000
+static BOOL AllBoards = FALSE;
+static char *Ports[MAX_BOARDS];
+static int NumPorts = 0;
+
+// From CMD_DEVICE_INFO: BOOT_ENTRY_WARM if the application sent the device
+// to download mode, in which case it waits for us to say when we're done.
+static PER_BOARD DWORD BootEntry = 0;
+
+// Where the application slots may start (see CMD_BOOT_SLOTS); an S records
+// file that starts at one of them is loaded there, anything else goes to
+// the first slot.
+#define APP_BASE            0x102000
+#define APP_END             0x140000
+#define APP_SLOT_ALIGN      0x2000
+
+//-----------------------------------------------------------------------------
+// One of the boards of a parallel load (see LoadBoards), and how it went.
+//-----------------------------------------------------------------------------
+#if defined(__linux__)
+typedef struct {
+    char path[USB_PATH_MAX];
+    HANDLE handle;
+    BOOL ok;
+    uint32_t version;
+    DWORD pages;
+    DWORD ms;
+    char line[128];
+    int lineLen;
+    char last[128];
+} Board;
+
+static Board Boards[MAX_BOARDS];
+static int NumBoards = 0;
+static PER_BOARD Board *Self;
+#endif
+
+//-----------------------------------------------------------------------------
+// printf, for everything that we say while talking to a device. In a
+// board's thread the lines get the board's port path in front, and the
+// last one is kept, to show why the board failed.
+//-----------------------------------------------------------------------------
+static int Print(const char *fmt, ...)
+{
+    va_list ap;
+    int n;
+
+    va_start(ap, fmt);
+#if defined(__linux__)
+    if(Self) {
+        char buf[1024];
+        int i;
+
+        n = vsnprintf(buf, sizeof(buf), fmt, ap);
+        va_end(ap);
+
+        for(i = 0; buf[i]; i++) {
+            if(buf[i] != '\n') {
+                if(Self->lineLen < (int)sizeof(Self->line) - 1)
+                    Self->line[Self->lineLen++] = buf[i];
+                continue;
+            }
+            if(Self->lineLen == 0)
+                continue;
+            Self->line[Self->lineLen] = '\0';
+            printf("%-8s %s\n", Self->path, Self->line);
+            fflush(stdout);
+            strcpy(Self->last, Self->line);
+            Self->lineLen = 0;
+        }
+        return n;
+    }
+#endif
+    n = vprintf(fmt, ap);
+    va_end(ap);
+    return n;
+}
+
+//-----------------------------------------------------------------------------
+// Give up on the device. With several boards that only ends this board's
+// thread, which gets back to BoardThread; otherwise we are done.
+//-----------------------------------------------------------------------------
+static PER_BOARD jmp_buf *FailJump;
+
+static void Fail(void) __attribute__((noreturn));
+
+static void Fail(void)
+{
+    if(FailJump)
+        longjmp(*FailJump, 1);
+    exit(-1);
+}
 
 static void ShowError(void)
 {
     char buf[1024];
     FormatMessage(FORMAT_MESSAGE_FROM_SYSTEM, NULL, GetLastError(), 0,
         buf, sizeof(buf), NULL);
-    printf("ERROR: %s", buf);
+    Print("ERROR: %s", buf);
 }
 
 static BOOL UsbConnect(void)
@@ -183,16 +314,48 @@ static BOOL UsbConnect(void)
 #endif
 }
 
+//-----------------------------------------------------------------------------
+// Let go of the device that UsbConnect or UsbWaitForDevice opened.
+//-----------------------------------------------------------------------------
+static void UsbDisconnect(void)
+{
+#if defined(WIN32) || defined(__linux__)
+    CloseHandle(UsbHandle);
+#endif
+    UsbHandle = NULL;
+}
+
+//-----------------------------------------------------------------------------
+// Wait up to timeout_ms (for good if negative) for the device to show up,
+// and connect to it. On Linux libusb's hotplug events wake us up as soon as
+// it has enumerated; elsewhere we look for it every 5 ms.
+//-----------------------------------------------------------------------------
+static BOOL UsbWaitForDevice(int timeout_ms)
+{
+#if defined(__linux__)
+    return UsbWaitConnect3(OUR_VID, OUR_PID, &UsbHandle, timeout_ms);
+#else
+    int i;
+    for(i = 0; timeout_ms < 0 || i < timeout_ms / 5; i++) {
+        if(UsbConnect()) {
+            return TRUE;
+        }
+        Sleep(5);
+    }
+    return FALSE;
+#endif
+}
+
 //-----------------------------------------------------------------------------
 // Try to receive a command over USB. If we do, the copy it into *c and return
 // TRUE; otherwise return FALSE.
 //-----------------------------------------------------------------------------
 static BOOL ReceiveCommandPoll(UsbCommand *c)
 {
-    static BOOL ReadInProgress = FALSE;
-    static OVERLAPPED Ov;
-    static BYTE Buf[65];
-    static DWORD HaveRead;
+    static PER_BOARD BOOL ReadInProgress = FALSE;
+    static PER_BOARD OVERLAPPED Ov;
+    static PER_BOARD BYTE Buf[65];
+    static PER_BOARD DWORD HaveRead;
 
     if(!ReadInProgress) {
         memset(&Ov, 0, sizeof(Ov));
@@ -204,7 +367,7 @@ static BOOL ReceiveCommandPoll(UsbCommand *c)
 
         if(GetLastError() != ERROR_IO_PENDING) {
             ShowError();
-            exit(-1);
+            Fail();
         }
         ReadInProgress = TRUE;
     }
@@ -214,7 +377,7 @@ static BOOL ReceiveCommandPoll(UsbCommand *c)
 
         if(!GetOverlappedResult(UsbHandle, &Ov, &HaveRead, FALSE)) {
             ShowError();
-            exit(-1);
+            Fail();
         }
 
         memcpy(c, Buf+1, 64);
@@ -226,9 +389,10 @@ static BOOL ReceiveCommandPoll(UsbCommand *c)
 }
 
 //-----------------------------------------------------------------------------
-// Block until we receive a command, and then return it in *c. Actually
-// we are just spinning on ReceiveCommandPoll, but try not to chew up too
-// much CPU while doing so.
+// Block until we receive a command, and then return it in *c. On Linux
+// ReadFile itself sleeps until a transfer completes, so the first poll
+// returns it; elsewhere we spin on ReceiveCommandPoll, but try not to chew
+// up too much CPU while doing so.
 //-----------------------------------------------------------------------------
 static void ReceiveCommand(UsbCommand *c)
 {
@@ -238,15 +402,14 @@ static void ReceiveCommand(UsbCommand *c)
 }
 
 //-----------------------------------------------------------------------------
-// Send a command; if wantAck is true, then try to receive a command right
-// after, and verify that it is an ACK (our higher-level ACK, not the USB
-// ACK).
+// Send one 64 byte report to the device; that is either a UsbCommand or raw
+// payload following a CMD_WRITE_PAGES header.
 //-----------------------------------------------------------------------------
-static void SendCommand(UsbCommand *c, BOOL wantAck)
+static void SendPacket(const void *data)
 {
     BYTE buf[65];
     buf[0] = 0;
-    memcpy(buf+1, c, 64);
+    memcpy(buf+1, data, 64);
 
     DWORD written;
     OVERLAPPED ov;
@@ -254,7 +417,7 @@ static void SendCommand(UsbCommand *c, BOOL wantAck)
     WriteFile(UsbHandle, buf, 65, &written, &ov);
     if(GetLastError() != ERROR_IO_PENDING) {
         ShowError();
-        exit(-1);
+        Fail();
     }
     
     while(!HasOverlappedIoCompleted(&ov)) {
@@ -263,16 +426,44 @@ static void SendCommand(UsbCommand *c, BOOL wantAck)
 
     if(!GetOverlappedResult(UsbHandle, &ov, &written, FALSE)) {
         ShowError();
-        exit(-1);
+        Fail();
     }
+}
+
+//-----------------------------------------------------------------------------
+// Reserve n consecutive sequence numbers and return the first one. Older
+// bootloaders don't know about sequence numbers, and want to see zero there.
+//-----------------------------------------------------------------------------
+static DWORD NextSeq(DWORD n)
+{
+    DWORD seq;
+
+    if(BootloaderVersion < 0x00010005)
+        return 0;
+
+    seq = SeqCounter & 0xffff;
+    SeqCounter += n;
+    return seq;
+}
+
+//-----------------------------------------------------------------------------
+// Send a command; if wantAck is true, then try to receive a command right
+// after, and verify that it is an ACK (our higher-level ACK, not the USB
+// ACK).
+//-----------------------------------------------------------------------------
+static void SendCommand(UsbCommand *c, BOOL wantAck)
+{
+    DWORD seq = NextSeq(1);
+    c->cmd = CMD_WITH_SEQ(CMD_CODE(c->cmd), seq);
+    SendPacket(c);
 
     if(wantAck) {
         UsbCommand ack;
         ReceiveCommand(&ack);
         memcpy(c, &ack, sizeof(ack));
-        if(ack.cmd != CMD_ACK) {
-            printf("bad ACK\n");
-            exit(-1);
+        if(ack.cmd != CMD_WITH_SEQ(CMD_ACK, seq)) {
+            Print("bad ACK\n");
+            Fail();
         }
     }
 }
@@ -282,109 +473,550 @@ static void SendCommand(UsbCommand *c, BOOL wantAck)
 // we are assuming that the S records are in order.
 static DWORD ExpectedAddr;
 
-// The bytes that are currently queued to send; we wait until we get a full
-// page's worth.
-static BYTE QueuedToSend[256];
-
-// This is TRUE if all of the bytes currently in QueuedToSend have already
-// been written to the device, else FALSE.
-static BOOL AllWritten;
-
-static uint32_t feed_crc32(uint32_t crc, void* memory, unsigned int length)
-{
-    unsigned char* data = (unsigned char*)memory;
-    crc = ~crc;
+// The image to be written, as collected from the S records or the binary
+// file; ImageSize bytes starting at flash address ImageBase. Anything past
+// the end of the data up to the next page boundary is 0xff.
+static BYTE Image[FLASH_SIZE];
+static DWORD ImageBase;
+static DWORD ImageSize;
 
-    if (data == 0 && length == 0xffffffff) {
-        crc = length;
-        length = 0;
-    }
+// The number of pages handed to the device, out of the PagesToWrite that
+// differ from what is in flash, and the tick count at which the current
+// download was started; used to report the progress and the throughput.
+static PER_BOARD DWORD PagesWritten;
+static PER_BOARD DWORD PagesToWrite;
+static PER_BOARD DWORD StartTicks;
 
-    for (uint32_t i = 0; i < length; ++i) {
-        uint32_t byte = *data++;
-        crc = crc ^ byte;
+// The number of bytes of page data (compressed or not) that went over USB
+// for those pages.
+static PER_BOARD DWORD WireBytes;
 
-        for (int j = 7; j >= 0; j--) {    // Do eight times.
-            uint32_t mask = -(crc & 1);
-            crc = (crc >> 1) ^ (0xEDB88320 & mask);
+//-----------------------------------------------------------------------------
+// Count a page as written, and show it: a dot on a line of dots, or with
+// several boards, where every line has a board's name in front, a line for
+// every tenth of the pages.
+//-----------------------------------------------------------------------------
+static void PageWritten(void)
+{
+    PagesWritten++;
+#if defined(__linux__)
+    if(Self) {
+        if(PagesToWrite && PagesWritten * 10 / PagesToWrite !=
+            (PagesWritten - 1) * 10 / PagesToWrite)
+        {
+            Print("%d of %d pages written\n", (int)PagesWritten, (int)PagesToWrite);
         }
+        return;
     }
-
-    return ~crc;
-}
-
-static uint32_t crc32(void* memory, unsigned int length)
-{
-    uint32_t crc = 0;
-    crc = feed_crc32(crc, 0, 0xffffffff);
-    return feed_crc32(crc, memory, length);
+#endif
+    Print(".");
 }
 
 //-----------------------------------------------------------------------------
-// Called when we have accumulated a full page's worth of bytes in
-// QueuedToSend; we copy them over to the device, and then tell the device
-// to write them to flash.
+// Write one page with the old protocol: the data goes over in five
+// CMD_SETUP_WRITE chunks, and CMD_FINISH_WRITE brings the last 16 bytes and
+// tells the device to write the page to flash. Every one of them is ACKed.
 //-----------------------------------------------------------------------------
-static void FlushPrevious(void)
+static void WritePageLegacy(DWORD addr, BYTE *data)
 {
     UsbCommand c;
     memset(&c, 0, sizeof(c));
 
-    //printf("expected = %08x flush\n", ExpectedAddr);
-
 #if FLASH_PAGE_SIZE != 256
 #error Fix download format for different page size!
 #endif
     int i;
     for(i = 0; i < 240; i += 48) {
         c.cmd = CMD_SETUP_WRITE;
-        memcpy(c.d.asBytes, QueuedToSend+i, 48);
+        memcpy(c.d.asBytes, data+i, 48);
         c.ext1 = (i/4);
         SendCommand(&c, TRUE);
         if (VerifyTransfers) {
-            unsigned int crc = crc32(QueuedToSend+i, 48);
+            unsigned int crc = crc32(data+i, 48);
             if (crc != c.ext1)
-                printf("\nUSB packet CRC32 mismatch on CMD_SETUP_WRITE!\n");
+                Print("\nUSB packet CRC32 mismatch on CMD_SETUP_WRITE!\n");
         }
     }
 
     c.cmd = CMD_FINISH_WRITE;
-    c.ext1 = (ExpectedAddr-1) & (~255);
-    //printf("    c.ext1 = %08x\n", c.ext1);
-    printf(".");
-    memcpy(c.d.asBytes, QueuedToSend+240, 16);
+    c.ext1 = addr;
+    memcpy(c.d.asBytes, data+240, 16);
     SendCommand(&c, TRUE);
     if (VerifyTransfers) {
-        unsigned int crc = crc32(QueuedToSend+240, 16);
+        unsigned int crc = crc32(data+240, 16);
         if (crc != c.ext1)
-            printf("\nUSB packet CRC32 mismatch on CMD_FINISH_WRITE!\n");
+            Print("\nUSB packet CRC32 mismatch on CMD_FINISH_WRITE!\n");
+    }
+
+    WireBytes += 6 * sizeof(c);
+    PageWritten();
+}
+
+//-----------------------------------------------------------------------------
+// Receive the UsbPageStatus for the page at addr, and check it.
+//-----------------------------------------------------------------------------
+static void ReceivePageStatus(DWORD addr, DWORD seq, BYTE *data)
+{
+    UsbCommand reply;
+    ReceiveCommand(&reply);
+    UsbPageStatus *st = (UsbPageStatus *)&reply;
+
+    if(st->cmd != CMD_WITH_SEQ(CMD_PAGE_STATUS, seq) || st->addr != addr) {
+        Print("\nbad page status (expected %08x)\n", addr);
+        Fail();
+    }
+    if(st->status) {
+        Print("\nflash error %08x writing page at %08x\n", st->status, addr);
+        Fail();
+    }
+    if(VerifyTransfers && (uint32_t)st->crc != crc32(data, FLASH_PAGE_SIZE)) {
+        Print("\nCRC32 mismatch on page at %08x!\n", addr);
+        Fail();
+    }
+
+    PageWritten();
+}
+
+//-----------------------------------------------------------------------------
+// Write a run of consecutive pages with CMD_WRITE_PAGES: a single header,
+// then the raw page data in 64 byte reports, and one short UsbPageStatus
+// back from the device for every page once it is in flash. We keep sending
+// until there are window pages without a status yet, so that the device
+// can program one page while the next ones are on the bus.
+//-----------------------------------------------------------------------------
+static void WritePagesStreaming(DWORD addr, BYTE *data, DWORD pages)
+{
+    DWORD window = DeviceWindow;
+    DWORD sent, done;
+    BOOL haveSeq = BootloaderVersion >= 0x00010005;
+
+    if(Window && Window < window)
+        window = Window;
+
+    UsbCommand c;
+    memset(&c, 0, sizeof(c));
+    c.cmd = CMD_WRITE_PAGES;
+    c.ext1 = addr;
+    c.ext2 = pages;
+    SendCommand(&c, FALSE);
+
+    // SendCommand took the header's sequence number; the pages follow it.
+    DWORD seq = CMD_SEQ(c.cmd);
+    NextSeq(pages);
+
+    sent = 0;
+    done = 0;
+    while(done < pages) {
+        if(sent < pages && sent - done < window) {
+            int i;
+            for(i = 0; i < FLASH_PAGE_SIZE; i += 64) {
+                SendPacket(data + sent*FLASH_PAGE_SIZE + i);
+            }
+            WireBytes += FLASH_PAGE_SIZE;
+            sent++;
+        } else {
+            ReceivePageStatus(addr + done*FLASH_PAGE_SIZE,
+                haveSeq ? ((seq + done) & 0xffff) : 0,
+                data + done*FLASH_PAGE_SIZE);
+            done++;
+        }
+    }
+}
+
+//-----------------------------------------------------------------------------
+// Compress len bytes with the LZSS scheme of CMD_WRITE_COMPRESSED, greedily,
+// finding matches through hash chains of three byte prefixes. For every
+// page, pageEnd[] gets the number of compressed bytes that the device needs
+// to have before it can write that page. Returns the compressed length.
+//-----------------------------------------------------------------------------
+#define LZ_HASH_SIZE 4096
+
+// What Compress and WritePagesCompressed work in. It is well over a MB, so
+// a thread only allocates it once it compresses, and a board's thread frees
+// it when it is done with the board.
+typedef struct {
+    int head[LZ_HASH_SIZE];
+    int prev[FLASH_SIZE];
+    BYTE packed[FLASH_SIZE + FLASH_SIZE/8 + 64];
+    DWORD pageEnd[FLASH_SIZE / FLASH_PAGE_SIZE];
+} LzWorkspace;
+
+static PER_BOARD LzWorkspace *LzWork;
+
+static DWORD Compress(const BYTE *in, DWORD len, BYTE *out, DWORD *pageEnd)
+{
+    int *head = LzWork->head;
+    int *prev = LzWork->prev;
+    DWORD pos = 0, n = 0, flagPos = 0, page = 0, p;
+    int items = 8, i;
+
+    for(i = 0; i < LZ_HASH_SIZE; i++) {
+        head[i] = -1;
+    }
+
+    while(pos < len) {
+        DWORD bestLen = 0, bestDist = 0, step;
+
+        if(pos + LZ_MIN_MATCH <= len) {
+            DWORD max = len - pos < LZ_MAX_MATCH ? len - pos : LZ_MAX_MATCH;
+            int cand = head[(in[pos] << 4 ^ in[pos+1] << 2 ^ in[pos+2]) % LZ_HASH_SIZE];
+            int chain = 0;
+
+            while(cand >= 0 && pos - cand <= LZ_WINDOW_SIZE && chain++ < 256) {
+                DWORD l = 0;
+                while(l < max && in[cand+l] == in[pos+l])
+                    l++;
+                if(l > bestLen) {
+                    bestLen = l;
+                    bestDist = pos - cand;
+                    if(l == max)
+                        break;
+                }
+                cand = prev[cand];
+            }
+        }
+
+        if(items == 8) {
+            flagPos = n++;
+            out[flagPos] = 0;
+            items = 0;
+        }
+        if(bestLen >= LZ_MIN_MATCH) {
+            out[flagPos] |= 1 << items;
+            out[n++] = (bestDist - 1) & 0xff;
+            out[n++] = ((bestDist - 1) >> 8) | ((bestLen - LZ_MIN_MATCH) << 2);
+            step = bestLen;
+        } else {
+            out[n++] = in[pos];
+            step = 1;
+        }
+        items++;
+
+        for(p = pos; p < pos + step; p++) {
+            if(p + LZ_MIN_MATCH <= len) {
+                int h = (in[p] << 4 ^ in[p+1] << 2 ^ in[p+2]) % LZ_HASH_SIZE;
+                prev[p] = head[h];
+                head[h] = p;
+            }
+        }
+        pos += step;
+
+        while((page + 1) * FLASH_PAGE_SIZE <= pos) {
+            pageEnd[page++] = n;
+        }
+    }
+
+    return n;
+}
+
+//-----------------------------------------------------------------------------
+// Write a run of consecutive pages with CMD_WRITE_COMPRESSED. This is paced
+// like WritePagesStreaming, except that one report may complete several
+// pages (or none); we send the next report if that leaves no more than
+// window pages without a status, or if nothing is outstanding at all.
+//-----------------------------------------------------------------------------
+static void WritePagesCompressed(DWORD addr, BYTE *data, DWORD pages)
+{
+    BYTE *packed;
+    DWORD *pageEnd;
+    DWORD window = DeviceWindow;
+    DWORD len, reports, sent, complete, after, done;
+
+    if(Window && Window < window)
+        window = Window;
+
+    if(!LzWork) {
+        LzWork = malloc(sizeof(*LzWork));
+        if(!LzWork) {
+            WritePagesStreaming(addr, data, pages);
+            return;
+        }
+    }
+    packed = LzWork->packed;
+    pageEnd = LzWork->pageEnd;
+
+    len = Compress(data, pages * FLASH_PAGE_SIZE, packed, pageEnd);
+    if(len >= pages * FLASH_PAGE_SIZE) {
+        WritePagesStreaming(addr, data, pages);
+        return;
     }
+    reports = (len + 63) / 64;
+    memset(packed + len, 0, reports*64 - len);
 
-    AllWritten = TRUE;
+    UsbCommand c;
+    memset(&c, 0, sizeof(c));
+    c.cmd = CMD_WRITE_COMPRESSED;
+    c.ext1 = addr;
+    c.ext2 = pages;
+    c.ext3 = len;
+    SendCommand(&c, FALSE);
+
+    DWORD seq = CMD_SEQ(c.cmd);
+    NextSeq(pages);
+
+    sent = 0;
+    complete = 0;
+    done = 0;
+    while(done < pages) {
+        if(sent < reports) {
+            for(after = complete;
+                after < pages && pageEnd[after] <= (sent + 1) * 64; after++)
+                ;
+            if(after - done <= window || done == complete) {
+                SendPacket(packed + sent*64);
+                WireBytes += 64;
+                sent++;
+                complete = after;
+                continue;
+            }
+        }
+        ReceivePageStatus(addr + done*FLASH_PAGE_SIZE, (seq + done) & 0xffff,
+            data + done*FLASH_PAGE_SIZE);
+        done++;
+    }
+}
+
+//-----------------------------------------------------------------------------
+// Start timing a download.
+//-----------------------------------------------------------------------------
+static void StartThroughput(void)
+{
+    PagesWritten = 0;
+    WireBytes = 0;
+    StartTicks = GetTickCount();
+}
+
+//-----------------------------------------------------------------------------
+// Print how many pages have been written since StartThroughput(), and how
+// fast that was.
+//-----------------------------------------------------------------------------
+static void ShowThroughput(void)
+{
+    DWORD ms = GetTickCount() - StartTicks;
+    if (ms == 0)
+        ms = 1;
+
+    Print("%d pages in %d.%03d s (%d pages/s, %d bytes/s)\n",
+        (int)PagesWritten, (int)(ms / 1000), (int)(ms % 1000),
+        (int)(PagesWritten * 1000 / ms),
+        (int)(PagesWritten * FLASH_PAGE_SIZE * 1000 / ms));
+
+    if (PagesWritten && WireBytes != PagesWritten * FLASH_PAGE_SIZE) {
+        Print("%d bytes sent for %d bytes of pages (%d%%), %d bytes/s over USB\n",
+            (int)WireBytes, (int)(PagesWritten * FLASH_PAGE_SIZE),
+            (int)(WireBytes * 100.0 / (PagesWritten * FLASH_PAGE_SIZE)),
+            (int)(WireBytes * 1000.0 / ms));
+    }
+}
+
+//-----------------------------------------------------------------------------
+// Start collecting a new image that is to be written at address base.
+//-----------------------------------------------------------------------------
+static void StartImage(DWORD base)
+{
+    memset(Image, 0xff, sizeof(Image));
+    ImageBase = base;
+    ImageSize = 0;
+    ExpectedAddr = base;
+}
+
+//-----------------------------------------------------------------------------
+// Ask the device for the CRC32 of each of the pages pages starting at addr.
+//-----------------------------------------------------------------------------
+static void ReadPageCrcs(DWORD addr, DWORD pages, uint32_t *crcs)
+{
+    while(pages > 0) {
+        DWORD n = pages < CRC32_PAGES_MAX ? pages : CRC32_PAGES_MAX;
+        DWORD i;
+
+        UsbCommand c;
+        memset(&c, 0, sizeof(c));
+        c.cmd = CMD_CRC32_PAGES;
+        c.ext1 = addr;
+        c.ext2 = n;
+        SendCommand(&c, TRUE);
+
+        for(i = 0; i < n; i++) {
+            *crcs++ = c.d.asDwords[i];
+        }
+        addr += n*FLASH_PAGE_SIZE;
+        pages -= n;
+    }
+}
+
+//-----------------------------------------------------------------------------
+// Write pages pages of the image that have to be sent as data, starting
+// with page first.
+//-----------------------------------------------------------------------------
+static void WriteDataPages(DWORD first, DWORD pages)
+{
+    DWORD addr = ImageBase + first*FLASH_PAGE_SIZE;
+    BYTE *data = Image + first*FLASH_PAGE_SIZE;
+    DWORD i;
+
+    if(BootloaderVersion >= 0x00010008 && !NoCompress) {
+        WritePagesCompressed(addr, data, pages);
+    } else if(BootloaderVersion >= 0x00010004) {
+        WritePagesStreaming(addr, data, pages);
+    } else {
+        for(i = 0; i < pages; i++) {
+            WritePageLegacy(addr + i*FLASH_PAGE_SIZE, data + i*FLASH_PAGE_SIZE);
+        }
+    }
+}
+
+//-----------------------------------------------------------------------------
+// Write pages pages of the image that all consist of the word fill, starting
+// with page first, with a single CMD_FILL_PAGES.
+//-----------------------------------------------------------------------------
+static void WriteFillPages(DWORD first, DWORD pages, DWORD fill)
+{
+    DWORD i;
+
+    UsbCommand c;
+    memset(&c, 0, sizeof(c));
+    c.cmd = CMD_FILL_PAGES;
+    c.ext1 = ImageBase + first*FLASH_PAGE_SIZE;
+    c.ext2 = pages;
+    c.ext3 = fill;
+    SendCommand(&c, FALSE);
+    WireBytes += sizeof(c);
+
+    DWORD seq = CMD_SEQ(c.cmd);
+    NextSeq(pages);
+
+    for(i = 0; i < pages; i++) {
+        ReceivePageStatus(ImageBase + (first + i)*FLASH_PAGE_SIZE,
+            (seq + i) & 0xffff, Image + (first + i)*FLASH_PAGE_SIZE);
+    }
+}
+
+//-----------------------------------------------------------------------------
+// Returns TRUE if page page of the image is one word repeated (most likely
+// 0xffffffff, in the gaps between S records) and the bootloader can fill
+// such pages itself; the word goes in *fill.
+//-----------------------------------------------------------------------------
+static BOOL IsFillPage(DWORD page, DWORD *fill)
+{
+    BYTE *data = Image + page*FLASH_PAGE_SIZE;
+    DWORD i;
+
+    if(BootloaderVersion < 0x00010009)
+        return FALSE;
+
+    for(i = 4; i < FLASH_PAGE_SIZE; i++) {
+        if(data[i] != data[i & 3])
+            return FALSE;
+    }
+    memcpy(fill, data, sizeof(*fill));
+    return TRUE;
+}
+
+//-----------------------------------------------------------------------------
+// Write pages pages of the image, starting with page first: runs of pages
+// that are filled with the same word with CMD_FILL_PAGES, everything else
+// as data.
+//-----------------------------------------------------------------------------
+static void WriteImagePages(DWORD first, DWORD pages)
+{
+    while(pages > 0) {
+        DWORD fill, next, n;
+        BOOL filled = IsFillPage(first, &fill);
+
+        for(n = 1; n < pages; n++) {
+            BOOL f = IsFillPage(first + n, &next);
+            if(f != filled || (f && next != fill))
+                break;
+        }
+
+        if(filled) {
+            WriteFillPages(first, n, fill);
+        } else {
+            WriteDataPages(first, n);
+        }
+        first += n;
+        pages -= n;
+    }
+}
+
+//-----------------------------------------------------------------------------
+// Write the collected image to the device. If the bootloader can tell us
+// what is in flash already, then we only write the pages that differ; that
+// makes a rebuild that touched a few pages quick, and lets a download that
+// was interrupted pick up where it stopped.
+//-----------------------------------------------------------------------------
+static void WriteImage(void)
+{
+    static PER_BOARD BYTE changed[FLASH_SIZE / FLASH_PAGE_SIZE];
+    static PER_BOARD uint32_t crcs[FLASH_SIZE / FLASH_PAGE_SIZE];
+    DWORD pages = (ImageSize + FLASH_PAGE_SIZE - 1) / FLASH_PAGE_SIZE;
+    DWORD i, first, n;
+
+    StartThroughput();
+    PagesToWrite = pages;
+
+    for(i = 0; i < pages; i++) {
+        changed[i] = TRUE;
+    }
+
+    if(!ForceWrite && BootloaderVersion >= 0x00010006) {
+        ReadPageCrcs(ImageBase, pages, crcs);
+
+        n = 0;
+        for(i = 0; i < pages; i++) {
+            changed[i] = crcs[i] != crc32(Image + i*FLASH_PAGE_SIZE, FLASH_PAGE_SIZE);
+            if(changed[i])
+                n++;
+        }
+        Print("%d of %d pages changed\n", (int)n, (int)pages);
+        PagesToWrite = n;
+    }
+
+    i = 0;
+    while(i < pages) {
+        if(!changed[i]) {
+            i++;
+            continue;
+        }
+        for(first = i; i < pages && changed[i]; i++)
+            ;
+        WriteImagePages(first, i - first);
+    }
 }
 
 //-----------------------------------------------------------------------------
 // Called for each byte in the S records; make sure that it is at the
-// address (where) where we expected it, and then tack it on to the page
-// to be written that we are working on. If we have a full page of data
-// ready to be written, call FlushPrevious() to write it and thus clear
-// out our buffer for the next page.
+// address (where) where we expected it, and then tack it on to the image
+// that we are collecting.
 //-----------------------------------------------------------------------------
 static void GotByte(DWORD where, BYTE which)
 {
-    AllWritten = FALSE;
-
     if(where != ExpectedAddr) {
         printf("bad: got at %08x, expected at %08x\n", where, ExpectedAddr);
         exit(-1);
     }
-    QueuedToSend[where & (FLASH_PAGE_SIZE-1)] = which;
+    if((uint32_t)(where - ImageBase) >= sizeof(Image)) {
+        printf("bad: %08x is past the end of flash\n", where);
+        exit(-1);
+    }
+    Image[where - ImageBase] = which;
     ExpectedAddr++;
+    ImageSize = ExpectedAddr - ImageBase;
+}
 
-    if((where & (FLASH_PAGE_SIZE-1)) == (FLASH_PAGE_SIZE-1)) {    
-        // we have completed a full page
-        FlushPrevious();
+//-----------------------------------------------------------------------------
+// Called when the S records skip ahead to address where. The image is 0xff
+// there already, so all we have to do is to move on; pages that end up all
+// 0xff never go over USB as data (see WriteImagePages).
+//-----------------------------------------------------------------------------
+static void GotGap(DWORD where)
+{
+    if((uint32_t)(where - ImageBase) > sizeof(Image)) {
+        printf("bad: %08x is past the end of flash\n", where);
+        exit(-1);
     }
+    ExpectedAddr = where;
+    ImageSize = ExpectedAddr - ImageBase;
 }
 
 //-----------------------------------------------------------------------------
@@ -413,16 +1045,60 @@ static BYTE HexByte(char *s)
 }
 
 //-----------------------------------------------------------------------------
-// Read S records from a file, and write them to the device. We verify that
-// the file starts at the correct address, which is why we need to know
-// whether the file being loaded is a bootrom or an application.
+// Print the device's application slots (see CMD_BOOT_SLOTS); first make the
+// slot at activate the default one, unless that is 0.
 //-----------------------------------------------------------------------------
-static void LoadFlashFromSRecords(char *file)
+static void ShowBootSlots(DWORD activate)
 {
-    uint32_t filesize = 0;
-    uint32_t file_crc32 = 0;
+    UsbCommand c;
+    int i;
+
+    if (BootloaderVersion < 0x0001000e) {
+        Print("Slots not supported - bootloader too old\n");
+        if (activate) {
+            Fail();
+        }
+        return;
+    }
 
-    ExpectedAddr = 0x102000L;
+    memset(&c, 0, sizeof(c));
+    c.cmd = CMD_BOOT_SLOTS;
+    c.ext1 = activate;
+    SendCommand(&c, TRUE);
+
+    if (c.ext2 == SLOTS_UNKNOWN) {
+        Print("No slot at 0x%08x - load an application there first\n", activate);
+        Fail();
+    } else if (c.ext2 != SLOTS_OK) {
+        Print("Switching to the slot at 0x%08x failed!\n", activate);
+        Fail();
+    }
+
+    for (i = 0; i < BOOT_SLOT_COUNT; i++) {
+        uint32_t base = c.d.asDwords[i*3];
+        uint32_t size = c.d.asDwords[i*3+1];
+        if (!base) {
+            continue;
+        }
+        Print("Slot %d : 0x%08x", i, base);
+        if (size) {
+            Print(", %d bytes, CRC32 %08x", size, (uint32_t)c.d.asDwords[i*3+2]);
+        } else {
+            Print(", not validated");
+        }
+        Print("%s%s\n", (uint32_t)c.ext1 == (uint32_t)i ? " (default)" : "",
+            (uint32_t)c.ext3 == base ? " (this boot)" : "");
+    }
+}
+
+//-----------------------------------------------------------------------------
+// Read S records from a file into the image. We verify that the file starts
+// at the correct address, which is why we need to know whether the file
+// being loaded is a bootrom or an application.
+//-----------------------------------------------------------------------------
+static void ReadSRecords(char *file)
+{
+    StartImage(APP_BASE);
 
     FILE *f = fopen(file, "r");
     if(!f) {
@@ -430,11 +1106,7 @@ static void LoadFlashFromSRecords(char *file)
         exit(-1);
     }
 
-    printf("Now uploading to: 0x%08x\n", ExpectedAddr);
-    fflush(0);
-
     char line[512];
-    file_crc32 = feed_crc32(file_crc32, 0, 0xffffffff);
     while(fgets(line, sizeof(line), f)) {
         if(memcmp(line, "S3", 2)==0) {
             char *s = line + 2;
@@ -449,63 +1121,124 @@ static void LoadFlashFromSRecords(char *file)
             s += 8;
 
             int i;
+            if(ImageSize == 0 && addr > APP_BASE && addr < APP_END &&
+                (addr - APP_BASE) % APP_SLOT_ALIGN == 0)
+            {
+                // an application linked for another slot
+                StartImage(addr);
+            }
+            if(addr > ExpectedAddr) {
+                GotGap(addr);
+            }
             for(i = 0; i < len; i++) {
-                uint8_t v = 0xff;
-                while((addr+i) > ExpectedAddr) {
-                    GotByte(ExpectedAddr, 0xff);
-                    file_crc32 = feed_crc32(file_crc32, &v, sizeof(v));
-                    filesize++;
-                }
-                v = HexByte(s);
-                GotByte(addr+i, v);
-                file_crc32 = feed_crc32(file_crc32, &v, sizeof(v));
-                filesize++;
+                GotByte(addr+i, HexByte(s));
                 s += 2;
             }
         }
     }
 
-    if(!AllWritten) FlushPrevious();
-
     fclose(f);
-    printf("\nflashing done. size = %d bytes ; CRC32 = %08x\n", filesize, file_crc32);
+
+    if(ImageBase + ImageSize > APP_END) {
+        printf("image doesn't fit: %d bytes at 0x%08x\n", ImageSize, ImageBase);
+        exit(-1);
+    }
+}
+
+//-----------------------------------------------------------------------------
+// Write the application that ReadSRecords collected to the device, and
+// make a boot record for it.
+//-----------------------------------------------------------------------------
+static void WriteApplication(void)
+{
+    uint32_t filesize = 0;
+    uint32_t file_crc32 = 0;
+
+    Print("Now uploading to: 0x%08x\n", ImageBase);
+    fflush(0);
+
+    // the image is contiguous from ImageBase, gaps filled with 0xff
+    filesize = ImageSize;
+    file_crc32 = crc32(Image, ImageSize);
+
+    WriteImage();
+    Print("\nflashing done. size = %d bytes ; CRC32 = %08x\n", filesize, file_crc32);
+    ShowThroughput();
     fflush(0);
 
     if (VerifyTransfers) {
-        printf("Verifying firmware...\n");
+        Print("Verifying firmware...\n");
 
         UsbCommand c;
         memset(&c, 0xfe, sizeof(c));
         c.cmd = CMD_CRC32_MEMORY;
-        c.ext1 = 0x102000L;
+        c.ext1 = ImageBase;
         c.ext2 = filesize;
         SendCommand(&c, TRUE);
 
         if (file_crc32 != c.ext1) {
-            printf("Firmware verification FAILED!\n");
-            exit(-1);
+            Print("Firmware verification FAILED!\n");
+            Fail();
         }
 
-        printf("Firmware verified OK!\n");
+        Print("Firmware verified OK!\n");
+    }
+
+    // Let a bootrom with validated boot know that this image is good.
+    if (BootloaderVersion >= 0x0001000d) {
+        UsbCommand c;
+        memset(&c, 0, sizeof(c));
+        c.cmd = CMD_VALIDATE_IMAGE;
+        c.ext1 = filesize;
+        c.ext2 = file_crc32;
+        c.ext3 = ImageBase;
+        if (ImageBase != APP_BASE && BootloaderVersion < 0x0001000e) {
+            Print("No boot record: bootloader too old for slot 0x%08x\n", ImageBase);
+            return;
+        }
+        SendCommand(&c, TRUE);
+
+        switch (c.ext2) {
+            case VALIDATE_OK:
+                Print("Boot record written.\n");
+                break;
+            case VALIDATE_NO_SLOT:
+                Print("No boot record: no free slot for 0x%08x!\n", ImageBase);
+                Fail();
+            case VALIDATE_NO_TAG:
+                Print("No boot record: the image has no application tag.\n");
+                break;
+            case VALIDATE_CRC_MISMATCH:
+                Print("No boot record: flash CRC32 is %08x, not %08x!\n",
+                    c.ext1, file_crc32);
+                Fail();
+            default:
+                Print("No boot record: writing it failed!\n");
+                Fail();
+        }
     }
 
+    if (Activate) {
+        ShowBootSlots(ImageBase);
+    }
 }
 
 //-----------------------------------------------------------------------------
-// Read binary data from a file, and write them to the device. 
+// Read binary data from a file, and write them to the device. Returns
+// whether the bootrom in flash changed.
 //-----------------------------------------------------------------------------
-static void LoadBootloaderFromBin(char *file, BOOL force)
+static BOOL LoadBootloaderFromBin(char *file, BOOL force)
 {
     DWORD addr = 0;
     uint32_t filesize = 0;
     uint32_t file_crc32 = 0;
 
-    ExpectedAddr = 0;
+    StartImage(0);
 
     FILE *f = fopen(file, "rb");
     if(!f) {
-        printf("couldn't open file\n");
-        exit(-1);
+        Print("couldn't open file\n");
+        Fail();
     }
 
     {
@@ -513,7 +1246,7 @@ static void LoadBootloaderFromBin(char *file, BOOL force)
         filesize = ftell(f);
         fseek(f, 0, SEEK_SET);
 
-        printf("Bootloader is %i bytes; ", filesize);
+        Print("Bootloader is %i bytes; ", filesize);
 
         void* mem = malloc(filesize);
         fread(mem, 1, filesize, f);
@@ -521,7 +1254,7 @@ static void LoadBootloaderFromBin(char *file, BOOL force)
         file_crc32 = crc32(mem, filesize);
         free(mem);
 
-        printf("CRC32 is %08x\n", file_crc32);
+        Print("CRC32 is %08x\n", file_crc32);
 
         if (!force) {
             UsbCommand c;
@@ -531,37 +1264,37 @@ static void LoadBootloaderFromBin(char *file, BOOL force)
             c.ext2 = filesize;
             SendCommand(&c, TRUE);
 
-            printf("Existing bootloader CRC32 is %08x\n", c.ext1);
+            Print("Existing bootloader CRC32 is %08x\n", c.ext1);
 
             if (file_crc32 == c.ext1) {
-                printf("Existing bootloader is up to date - skipping\n");
+                Print("Existing bootloader is up to date - skipping\n");
                 fclose(f);
-                return;
+                return FALSE;
             }
         } else {
-            printf("Ignoring existing bootloader - forcing update\n");
+            Print("Ignoring existing bootloader - forcing update\n");
         }
 
     }
 
-    printf("Fixing bootloader...\n");
+    Print("Fixing bootloader...\n");
     fflush(0);
 
-    while(!feof(f)) {
-      BYTE c=fgetc(f);
-      //printf("%04x %02x\n",addr,c);
-      GotByte(addr, c);
+    int ch;
+    while((ch = fgetc(f)) != EOF) {
+      //Print("%04x %02x\n",addr,ch);
+      GotByte(addr, ch);
       ++addr;
     }
 
-    if(!AllWritten) FlushPrevious();
-
     fclose(f);
-    printf("\nflashing done.\n");
+    WriteImage();
+    Print("\nflashing done.\n");
+    ShowThroughput();
     fflush(0);
 
     if (VerifyTransfers) {
-        printf("Verifying bootloader...\n");
+        Print("Verifying bootloader...\n");
 
         UsbCommand c;
         memset(&c, 0xfe, sizeof(c));
@@ -571,69 +1304,523 @@ static void LoadBootloaderFromBin(char *file, BOOL force)
         SendCommand(&c, TRUE);
 
         if (file_crc32 != c.ext1) {
-            printf("Bootloader verification FAILED!\n");
-            exit(-1);
+            Print("Bootloader verification FAILED!\n");
+            Fail();
+        }
+
+        Print("Bootloader verified OK!\n");
+    }
+
+    return TRUE;
+}
+
+//-----------------------------------------------------------------------------
+// Tell the device that we are done with it (CMD_HARDWARE_RESET): it starts
+// the application straight away, or resets to run a new bootrom, instead
+// of waiting for its timeout.
+//-----------------------------------------------------------------------------
+static void EndSession(BOOL reboot)
+{
+    UsbCommand c;
+
+    if (BootloaderVersion < 0x00010010) {
+        // older ones only listen after BOOT_REQUEST_DOWNLOAD, and can't reset
+        if (reboot || !(BootEntry & BOOT_ENTRY_WARM))
+            return;
+    }
+
+    memset(&c, 0, sizeof(c));
+    c.cmd = CMD_HARDWARE_RESET;
+    c.ext1 = reboot ? HARDWARE_RESET_REBOOT : HARDWARE_RESET_START;
+    SendCommand(&c, TRUE);
+
+    if (c.ext1 == HARDWARE_RESET_NO_APP) {
+        Print("No startable application - the device stays in the bootloader.\n");
+    } else if (reboot) {
+        Print("Restarting the device.\n");
+    } else {
+        Print("Starting the application.\n");
+    }
+}
+
+//-----------------------------------------------------------------------------
+// Ask the device what it is (CMD_DEVICE_INFO); the sizes of the bootloader
+// and of the application go in *bootloader_size and *firmware_size.
+//-----------------------------------------------------------------------------
+static void QueryDevice(uint32_t *bootloader_size, uint32_t *firmware_size)
+{
+    UsbCommand c;
+    memset(&c, 0xfe, sizeof(c));
+    c.cmd = CMD_DEVICE_INFO;
+    SendCommand(&c, TRUE);
+    if (c.ext1 != 0xfefefefe) {
+        BootloaderVersion = c.ext1;
+        *bootloader_size = c.ext2;
+        *firmware_size = c.ext3;
+        VerifyTransfers = 1;
+    }
+    if (BootloaderVersion >= 0x00010005) {
+        DeviceWindow = c.d.asDwords[0];
+    }
+    if (BootloaderVersion >= 0x0001000f) {
+        BootEntry = c.d.asDwords[1];
+    }
+
+    Print("Bootloader version : %08x\n", BootloaderVersion);
+}
+
+#if defined(__linux__)
+//-----------------------------------------------------------------------------
+// Open the boards to load: every one that is connected, or the ones at the
+// --port paths, waiting for them to enumerate as UsbWaitForDevice does.
+// Those that don't show up get a Board without a handle. Returns how many
+// are open.
+//-----------------------------------------------------------------------------
+static int ConnectBoards(void)
+{
+    HANDLE handles[MAX_BOARDS];
+    char paths[MAX_BOARDS][USB_PATH_MAX];
+    int found, i, j, n = 0;
+
+    printf("Waiting for %s...\n", AllBoards ? "the boards" : "the boards at --port");
+    fflush(0);
+    found = UsbWaitConnectPaths(OUR_VID, OUR_PID, Ports, NumPorts, handles, paths,
+        MAX_BOARDS, AllBoards ? ALL_SETTLE_MS : WaitForever ? -1 : CONNECT_TIMEOUT_MS);
+
+    if(AllBoards) {
+        for(i = 0; i < found; i++) {
+            strcpy(Boards[i].path, paths[i]);
+            Boards[i].handle = handles[i];
+        }
+        NumBoards = found;
+        return found;
+    }
+
+    for(i = 0; i < NumPorts; i++) {
+        strncpy(Boards[i].path, Ports[i], USB_PATH_MAX - 1);
+        for(j = 0; j < found; j++) {
+            if(strcmp(paths[j], Ports[i]) == 0) {
+                Boards[i].handle = handles[j];
+                n++;
+            }
+        }
+        if(!Boards[i].handle) {
+            strcpy(Boards[i].last, "not found");
+        }
+    }
+    NumBoards = NumPorts;
+    return n;
+}
+
+//-----------------------------------------------------------------------------
+// Load the application into one board, in a thread of its own.
+//-----------------------------------------------------------------------------
+static void *BoardThread(void *arg)
+{
+    uint32_t bootloader_size, firmware_size;
+    DWORD start = GetTickCount();
+    jmp_buf fail;
+
+    Self = arg;
+    UsbHandle = Self->handle;
+    FailJump = &fail;
+
+    if(!setjmp(fail)) {
+        QueryDevice(&bootloader_size, &firmware_size);
+        WriteApplication();
+        EndSession(FALSE);
+        Self->ok = TRUE;
+    }
+
+    // a message without its newline is still the most recent one
+    if(Self->lineLen) {
+        Self->line[Self->lineLen] = '\0';
+        strcpy(Self->last, Self->line);
+    }
+    Self->version = BootloaderVersion;
+    Self->pages = PagesWritten;
+    Self->ms = GetTickCount() - start;
+
+    UsbDisconnect();
+
+    free(LzWork);
+    LzWork = NULL;
+    return NULL;
+}
+
+//-----------------------------------------------------------------------------
+// Load the application in file into all the boards at once, one thread per
+// board, and print how it went for each. The S records are read only once;
+// the boards share the image, and only read it. Returns 0 if all of them
+// made it.
+//-----------------------------------------------------------------------------
+static int LoadBoards(char *file)
+{
+    pthread_t threads[MAX_BOARDS];
+    BOOL running[MAX_BOARDS];
+    DWORD start;
+    int i, failed = 0;
+
+    ReadSRecords(file);
+
+    printf("Loading %d bytes at 0x%08x into %d boards...\n",
+        (int)ImageSize, ImageBase, NumBoards);
+    fflush(0);
+
+    start = GetTickCount();
+    for(i = 0; i < NumBoards; i++) {
+        running[i] = Boards[i].handle &&
+            pthread_create(&threads[i], NULL, BoardThread, &Boards[i]) == 0;
+        if(Boards[i].handle && !running[i]) {
+            strcpy(Boards[i].last, "couldn't start a thread");
+            CloseHandle(Boards[i].handle);
+        }
+    }
+    for(i = 0; i < NumBoards; i++) {
+        if(running[i]) {
+            pthread_join(threads[i], NULL);
+        }
+    }
+
+    printf("\n%-8s %-10s %6s %9s  %s\n", "Port", "Bootloader", "Pages", "Time", "Result");
+    for(i = 0; i < NumBoards; i++) {
+        Board *b = &Boards[i];
+        if(!running[i]) {
+            printf("%-8s %-10s %6s %9s  %s\n", b->path, "-", "-", "-", b->last);
+        } else {
+            printf("%-8s %08x   %6d %3d.%03d s  %s\n", b->path, b->version,
+                (int)b->pages, (int)(b->ms / 1000), (int)(b->ms % 1000),
+                b->ok ? "OK" : b->last);
         }
+        if(!b->ok) {
+            failed++;
+        }
+    }
+
+    DWORD ms = GetTickCount() - start;
+    printf("%d of %d boards loaded in %d.%03d s\n", NumBoards - failed, NumBoards,
+        (int)(ms / 1000), (int)(ms % 1000));
+
+    return failed ? -1 : 0;
+}
+#endif
+
+//-----------------------------------------------------------------------------
+// Have the device compute the CRC32 of len bytes at addr with its table
+// driven loop and with the old bit-serial one, and print how long each took.
+//-----------------------------------------------------------------------------
+static void ShowCrcTiming(DWORD addr, DWORD len)
+{
+    DWORD cycles[2];
+    int i;
+
+    for (i = 0; i < 2; i++) {
+        UsbCommand c;
+        memset(&c, 0, sizeof(c));
+        c.cmd = CMD_CRC32_MEMORY;
+        c.ext1 = addr;
+        c.ext2 = len;
+        c.ext3 = i ? CRC32_MEMORY_BITWISE : 0;
+        SendCommand(&c, TRUE);
+        cycles[i] = c.ext2;
+    }
+
+    printf("CRC32 timing : table %d cycles (%d.%02d/byte), bit-serial %d cycles (%d.%02d/byte)\n",
+        (int)cycles[0], (int)(cycles[0] / len), (int)(cycles[0] * 100ull / len % 100),
+        (int)cycles[1], (int)(cycles[1] / len), (int)(cycles[1] * 100ull / len % 100));
+}
+
+//-----------------------------------------------------------------------------
+// Print the counters of the device's USB driver, if it has them.
+//-----------------------------------------------------------------------------
+static void ShowUsbStatistics(void)
+{
+    if (BootloaderVersion < 0x00010003)
+        return;
+
+    UsbCommand c;
+    memset(&c, 0, sizeof(c));
+    c.cmd = CMD_USB_STATISTICS;
+    SendCommand(&c, TRUE);
+
+    printf("USB reports received : %d (%d into the second bank, NAKs avoided)\n",
+        (int)c.d.asDwords[USB_STAT_RX_PACKETS],
+        (int)c.d.asDwords[USB_STAT_RX_NAKS_AVOIDED]);
+
+    // The interrupt driven receive path; the latency is in MCK/16 ticks,
+    // three of them to the microsecond.
+    if (c.ext1 > USB_STAT_RX_MAX_LATENCY) {
+        printf("USB receive queue    : at most %d reports waiting, full %d times\n",
+            (int)c.d.asDwords[USB_STAT_RX_MAX_QUEUED],
+            (int)c.d.asDwords[USB_STAT_RX_QUEUE_FULL]);
+        printf("USB receive latency  : %d us worst case, from the interrupt to handling\n",
+            (int)(c.d.asDwords[USB_STAT_RX_MAX_LATENCY] / 3));
+    }
+
+    if (c.ext1 > USB_STAT_EP0_STALLS) {
+        printf("USB enumeration      : %d ms from connect to configured, %d requests refused\n",
+            (int)(c.d.asDwords[USB_STAT_ENUM_TIME] / 3000),
+            (int)c.d.asDwords[USB_STAT_EP0_STALLS]);
+    }
+}
+
+//-----------------------------------------------------------------------------
+// Print when the device reached each stage of its boot (see
+// CMD_BOOT_TIMELINE), in ms since reset and since the stage before.
+//-----------------------------------------------------------------------------
+static const char *BootStageNames[BOOT_STAGE_COUNT] = {
+    "reset",
+    "oscillator up",
+    "PLL locked",
+    "RAM copy done",
+    "pull-up on",
+    "bus reset",
+    "configured",
+    "first command",
+    "jump to app",
+};
+
+static void ShowBootTimeline(void)
+{
+    UsbCommand c;
+    uint32_t pll, mainf, stamp;
+    double slowHz, ms, last = 0;
+    int i, n;
+
+    if (BootloaderVersion < 0x0001000c) {
+        printf("Command not supported - bootloader too old\n");
+        return;
+    }
 
-        printf("Bootloader verified OK!\n");
+    memset(&c, 0, sizeof(c));
+    c.cmd = CMD_BOOT_TIMELINE;
+    SendCommand(&c, TRUE);
+
+    n = c.ext1 < BOOT_STAGE_COUNT ? c.ext1 : BOOT_STAGE_COUNT;
+    pll = c.ext2;
+    mainf = c.ext3;
+
+    // Until the PLL takes over, the PIT counts the slow clock, which is
+    // an RC oscillator; MAINF tells us how fast it really runs.
+    slowHz = mainf ? 16.0 * 18432000.0 / mainf : 32768.0;
+    printf("Slow clock         : %.0f Hz%s\n", slowHz, mainf ? "" : " (assumed)");
+
+    for (i = 0; i < n; i++) {
+        stamp = c.d.asDwords[i];
+        if (stamp == BOOT_STAMP_NONE) {
+            printf("%-18s : -\n", BootStageNames[i]);
+            continue;
+        }
+        if (pll == BOOT_STAMP_NONE || stamp <= pll)
+            ms = stamp * 16000.0 / slowHz;
+        else
+            ms = pll * 16000.0 / slowHz + (stamp - pll) / 3000.0;
+        printf("%-18s : %9.3f ms  (+%.3f ms)\n", BootStageNames[i], ms, ms - last);
+        last = ms;
     }
 }
 
+//-----------------------------------------------------------------------------
+// Time the host's CRC32 implementations against each other, over the given
+// file or over a megabyte of made-up data. This doesn't need a device.
+//-----------------------------------------------------------------------------
+static int Benchmark(char *file)
+{
+    static const struct {
+        const char *name;
+        uint32_t (*fn)(uint32_t crc, const void *data, size_t length);
+    } engines[] = {
+        { "bitwise",    crc32_bitwise },
+        { "slice-by-8", crc32_slice8 },
+        { "pclmul",     crc32_pclmul },
+    };
+    BYTE *buf;
+    size_t len, i;
+    uint32_t reference = 0;
+
+    if(file) {
+        FILE *f = fopen(file, "rb");
+        if(!f) {
+            printf("couldn't open file\n");
+            return -1;
+        }
+        fseek(f, 0, SEEK_END);
+        len = ftell(f);
+        fseek(f, 0, SEEK_SET);
+        buf = malloc(len ? len : 1);
+        len = fread(buf, 1, len, f);
+        fclose(f);
+    } else {
+        len = 1024*1024;
+        buf = malloc(len);
+        for(i = 0; i < len; i++) {
+            buf[i] = (BYTE)(i * 2654435761u >> 13);
+        }
+    }
+
+    printf("CRC32 over %d bytes:\n", (int)len);
+    for(i = 0; i < sizeof(engines)/sizeof(engines[0]); i++) {
+        DWORD start, ms;
+        uint32_t crc;
+        double bytes = 0;
+
+        if(engines[i].fn == crc32_pclmul && !crc32_have_pclmul()) {
+            printf("  %-10s : not supported by this CPU\n", engines[i].name);
+            continue;
+        }
+
+        start = GetTickCount();
+        do {
+            crc = engines[i].fn(0, buf, len);
+            bytes += len;
+            ms = GetTickCount() - start;
+        } while(ms < 500);
+
+        if(i == 0) {
+            reference = crc;
+        }
+        printf("  %-10s : %08x %10.1f MB/s%s\n", engines[i].name, crc,
+            bytes / 1e3 / ms, crc != reference ? "  MISMATCH" : "");
+    }
+    printf("crc32_update uses %s\n", crc32_have_pclmul() ? "pclmul" : "slice-by-8");
+
+    free(buf);
+    return 0;
+}
+
+//-----------------------------------------------------------------------------
+// Take the --options out of argv, leaving the command and its arguments;
+// returns the new argc.
+//-----------------------------------------------------------------------------
+static int ParseOptions(int argc, char **argv)
+{
+    int i, n = 1;
+
+    for(i = 1; i < argc; i++) {
+        if(strncmp(argv[i], "--window=", 9) == 0) {
+            Window = atoi(argv[i] + 9);
+            if(Window < 1) {
+                printf("bad window size '%s'\n", argv[i] + 9);
+                exit(-1);
+            }
+        } else if(strcmp(argv[i], "--force") == 0) {
+            ForceWrite = TRUE;
+        } else if(strcmp(argv[i], "--no-compress") == 0) {
+            NoCompress = TRUE;
+        } else if(strcmp(argv[i], "--activate") == 0) {
+            Activate = TRUE;
+        } else if(strcmp(argv[i], "--wait") == 0) {
+            WaitForever = TRUE;
+        } else if(strcmp(argv[i], "--all") == 0) {
+            AllBoards = TRUE;
+        } else if(strncmp(argv[i], "--port=", 7) == 0) {
+            int j;
+            for(j = 0; j < NumPorts && strcmp(Ports[j], argv[i] + 7); j++)
+                ;
+            if(j < NumPorts) {
+                continue;
+            }
+            if(NumPorts == MAX_BOARDS) {
+                printf("too many ports, at most %d\n", MAX_BOARDS);
+                exit(-1);
+            }
+            Ports[NumPorts++] = argv[i] + 7;
+        } else if(strncmp(argv[i], "--", 2) == 0) {
+            printf("Unknown option '%s'\n", argv[i]);
+            exit(-1);
+        } else {
+            argv[n++] = argv[i];
+        }
+    }
+
+    return n;
+}
+
 int main(int argc, char **argv)
 {
-    int i = 0;
-    uint32_t bootloader_version = 0x0;
     uint32_t bootloader_size = 0x0;
     uint32_t firmware_size = 0x0;
 
+    argc = ParseOptions(argc, argv);
+    crc32_init();
+
     if(argc < 2) {
-        printf("Usage: %s load    <application>.s19\n", argv[0]);
+        printf("Usage: %s [--window=N] [--force] [--no-compress] [--activate] [--wait] load    <application>.s19\n", argv[0]);
+        printf("       %s [--all | --port=BUS-PORT[.PORT...] ...] load <application>.s19\n", argv[0]);
+        printf("       %s info | timeline | slots | activate <address> | bench [file]\n", argv[0]);
         return -1;
     }
-    if(strcmp(argv[1], "info") && argc != 3) {
+    if(strcmp(argv[1], "bench")==0) {
+        return Benchmark(argc > 2 ? argv[2] : NULL);
+    }
+    if(strcmp(argv[1], "info") && strcmp(argv[1], "timeline") &&
+        strcmp(argv[1], "slots") && argc != 3) {
         printf("Need filename.\n");
         return -1;
     }
 
     if( strcmp(argv[1], "full")==0 ||
         strcmp(argv[1], "load")==0 || 
-        strcmp(argv[1], "info")==0 ) {
-
-        for(;;) {
-            if(UsbConnect()) {
-                break;
+        strcmp(argv[1], "info")==0 ||
+        strcmp(argv[1], "timeline")==0 ||
+        strcmp(argv[1], "slots")==0 ||
+        strcmp(argv[1], "activate")==0 ) {
+
+        if(AllBoards || NumPorts > 0) {
+#if defined(__linux__)
+            if(ConnectBoards() == 0) {
+                printf("No device connected.\n");
+                return -1;
             }
-            if(i == 0) {
-                printf("No device connected, polling for it now...\n");
-                fflush(0);
+            if(AllBoards || NumBoards > 1) {
+                if(strcmp(argv[1], "load")) {
+                    printf("Only 'load' works with several boards.\n");
+                    return -1;
+                }
+                return LoadBoards(argv[2]);
             }
-            if(i > 50000) {
+            UsbHandle = Boards[0].handle;
+#else
+            printf("--all and --port need libusb (Linux).\n");
+            return -1;
+#endif
+        } else if(!UsbConnect()) {
+            printf("No device connected, waiting for it now...\n");
+            fflush(0);
+            if(!UsbWaitForDevice(WaitForever ? -1 : CONNECT_TIMEOUT_MS)) {
                 printf("...could not connect to USB device; exiting.\n");
                 return -1;
             }
-            i++;
-            Sleep(5);
         }
 
         printf("Device connected - quering version...\n");
 
-        UsbCommand c;
-        memset(&c, 0xfe, sizeof(c));
-        c.cmd = CMD_DEVICE_INFO;
-        SendCommand(&c, TRUE);
-        if (c.ext1 != 0xfefefefe) {
-            bootloader_version = c.ext1;
-            bootloader_size = c.ext2;
-            firmware_size = c.ext3;
-            VerifyTransfers = 1;
+        QueryDevice(&bootloader_size, &firmware_size);
+
+        if (strcmp(argv[1], "timeline")==0) {
+            ShowBootTimeline();
+            UsbDisconnect();
+            return 0;
+        }
+
+        if (strcmp(argv[1], "slots")==0) {
+            ShowBootSlots(0);
+            UsbDisconnect();
+            return 0;
         }
 
-        printf("Bootloader version : %08x\n", bootloader_version);
+        if (strcmp(argv[1], "activate")==0) {
+            ShowBootSlots(strtoul(argv[2], NULL, 0));
+            UsbDisconnect();
+            return 0;
+        }
 
         if (strcmp(argv[1], "info")==0) {
+            UsbCommand c;
 
-            if (bootloader_version == 0) {
+            if (BootloaderVersion == 0) {
                 printf("Command not supported - bootloader too old\n");
+                UsbDisconnect();
                 return 0;
             }
 
@@ -664,16 +1851,32 @@ int main(int argc, char **argv)
                 c.ext2 = firmware_size;
                 SendCommand(&c, TRUE);
                 printf("Firmware CRC32: %08x\n", c.ext1);
+
+                if (BootloaderVersion >= 0x00010007) {
+                    ShowCrcTiming(0x102000, firmware_size);
+                }
             }
 
+            if (BootloaderVersion >= 0x0001000e) {
+                ShowBootSlots(0);
+            }
+            ShowUsbStatistics();
+            UsbDisconnect();
             return 0;
         }
 
+        BOOL newBootrom = FALSE;
         if(strcmp(argv[1], "full")==0) {
-            LoadBootloaderFromBin("bootrom.bin", bootloader_version == 0x0);
+            newBootrom = LoadBootloaderFromBin("bootrom.bin", BootloaderVersion == 0x0);
         }
 
-        LoadFlashFromSRecords(argv[2]);
+        ReadSRecords(argv[2]);
+        WriteApplication();
+        ShowUsbStatistics();
+
+        // the bootrom that runs now is the old one; a reset starts the new
+        EndSession(newBootrom);
+        UsbDisconnect();
 
     } else {
         printf("Command '%s' not recognized.\n", argv[1]);
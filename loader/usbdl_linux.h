@@ -8,6 +8,9 @@
 #include <string.h>
 #include <libusb.h>
 #include <pthread.h>
+#include <time.h>
+#include <errno.h>
+#include <sys/time.h>
 
 typedef unsigned char BYTE;
 typedef signed int DWORD;
@@ -25,70 +28,412 @@ typedef void* HANDLE;
 
 typedef struct _OVERLAPPED { } OVERLAPPED, *LPOVERLAPPED;
 
-static volatile int32_t bytes_transferred = 0;
-static uint8_t buffer[64];
+static libusb_context *usb_context = NULL;
 
-static void transfer_callback(struct libusb_transfer *transfer)
+// The reports that go over USB, without the report ID byte that the Win32
+// style ReadFile/WriteFile below have in front.
+#define USB_REPORT_SIZE		64
+
+// How many transfers we keep on the way in each direction. The OUT ones
+// carry what WriteFile hands us, so that the host controller has the next
+// report ready as soon as the device takes the last one; the IN ones make
+// sure that there's always a buffer for the device's next report.
+#define USB_OUT_TRANSFERS	16
+#define USB_IN_TRANSFERS	4
+
+// The device NAKs OUT reports while its page buffers are full, so an OUT
+// transfer may take a while, but not this long. The IN transfers wait for
+// as long as it takes; ReadFile gives up after USB_IN_TIMEOUT_MS.
+#define USB_OUT_TIMEOUT_MS	2000
+#define USB_IN_TIMEOUT_MS	5000
+
+struct usb_session;
+
+typedef struct usb_xfer {
+	struct usb_session *session;
+	struct libusb_transfer *transfer;
+	struct usb_xfer *next;
+	uint8_t data[USB_REPORT_SIZE];
+} usb_xfer;
+
+// Everything about one open device; the HANDLE that UsbConnect3 returns.
+typedef struct usb_session {
+	libusb_device_handle *handle;
+	int interface_num;			// the interface that we claimed
+	usb_xfer out[USB_OUT_TRANSFERS];
+	usb_xfer in[USB_IN_TRANSFERS];
+	usb_xfer *out_free;			// OUT transfers that WriteFile may use
+	usb_xfer *in_head;			// completed IN transfers, oldest first
+	usb_xfer *in_tail;
+	int error;					// errno for the first transfer that failed
+	int completed;				// set by the callbacks, for usb_wait
+	int pending;				// transfers submitted and not called back yet
+} usb_session;
+
+// With several boards every one has a thread of its own, and the callbacks
+// for one board's transfers may run in another board's thread (whichever
+// handles libusb's events); this guards the lists and flags above.
+static pthread_mutex_t usb_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// errno for what went wrong last in this thread, for GetLastError/FormatMessage.
+static __thread int usb_last_error = 0;
+
+static int transfer_errno(enum libusb_transfer_status status)
 {
-	if (transfer->status == LIBUSB_TRANSFER_CANCELLED)
-		return;
-
-	if (transfer->status == LIBUSB_TRANSFER_TIMED_OUT ||
-		transfer->status == LIBUSB_TRANSFER_STALL)
+	switch (status)
 	{
-		printf("r");
-		libusb_submit_transfer(transfer);
-		return;
+		case LIBUSB_TRANSFER_TIMED_OUT:	return ETIMEDOUT;
+		case LIBUSB_TRANSFER_STALL:		return EPIPE;
+		case LIBUSB_TRANSFER_NO_DEVICE:	return ENODEV;
+		case LIBUSB_TRANSFER_OVERFLOW:	return EOVERFLOW;
+		default:						return EIO;
 	}
+}
+
+static void out_callback(struct libusb_transfer *transfer)
+{
+	usb_xfer *x = transfer->user_data;
+	usb_session *s = x->session;
+
+	pthread_mutex_lock(&usb_lock);
+	if (transfer->status != LIBUSB_TRANSFER_COMPLETED && !s->error)
+		s->error = transfer_errno(transfer->status);
+
+	x->next = s->out_free;
+	s->out_free = x;
+	s->pending--;
+	s->completed = 1;
+	pthread_mutex_unlock(&usb_lock);
+}
 
+static void in_callback(struct libusb_transfer *transfer)
+{
+	usb_xfer *x = transfer->user_data;
+	usb_session *s = x->session;
+
+	pthread_mutex_lock(&usb_lock);
 	if (transfer->status != LIBUSB_TRANSFER_COMPLETED)
-		return;
+	{
+		if (transfer->status != LIBUSB_TRANSFER_CANCELLED && !s->error)
+			s->error = transfer_errno(transfer->status);
+	}
+	else
+	{
+		x->next = NULL;
+		if (s->in_tail)
+			s->in_tail->next = x;
+		else
+			s->in_head = x;
+		s->in_tail = x;
+	}
+	s->pending--;
+	s->completed = 1;
+	pthread_mutex_unlock(&usb_lock);
+}
+
+// Let libusb run our callbacks until *ready is non-NULL, the session fails,
+// or timeout_ms have passed; returns FALSE (with usb_last_error set) if
+// there's nothing ready then, and with usb_lock held if there is. Another
+// thread may be handling the events; s->completed makes libusb return to
+// us as soon as it has run one of our callbacks.
+static BOOL usb_wait(usb_session *s, usb_xfer **ready, int timeout_ms)
+{
+	struct timespec start, now;
+	clock_gettime(CLOCK_MONOTONIC, &start);
 
-	if (bytes_transferred)
+	for (;;)
 	{
-		printf("unexpected callback!\n");
-		exit(-1);
+		pthread_mutex_lock(&usb_lock);
+		s->completed = 0;
+		if (*ready || s->error)
+			break;
+		pthread_mutex_unlock(&usb_lock);
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		long left = timeout_ms - ((now.tv_sec - start.tv_sec) * 1000 +
+			(now.tv_nsec - start.tv_nsec) / 1000000);
+		if (left <= 0)
+		{
+			usb_last_error = ETIMEDOUT;
+			return FALSE;
+		}
+
+		struct timeval tv = { left / 1000, (left % 1000) * 1000 };
+		if (libusb_handle_events_timeout_completed(usb_context, &tv, &s->completed))
+		{
+			usb_last_error = EIO;
+			return FALSE;
+		}
 	}
 
-	bytes_transferred = transfer->actual_length;
+	if (s->error)
+	{
+		usb_last_error = s->error;
+		pthread_mutex_unlock(&usb_lock);
+		return FALSE;
+	}
+	return TRUE;
 }
 
-static int submit_transfer(libusb_context* context, struct libusb_transfer* transfer)
+// Submit one of the session's transfers; a callback that may run in another
+// thread before libusb_submit_transfer returns finds it already counted in
+// s->pending. Returns FALSE (with s->error set) if libusb won't take it.
+static BOOL usb_submit(usb_session *s, usb_xfer *x)
 {
-	bytes_transferred = 0;
-	int res = libusb_submit_transfer(transfer);
-	if (res)
+	pthread_mutex_lock(&usb_lock);
+	s->pending++;
+	pthread_mutex_unlock(&usb_lock);
+
+	if (libusb_submit_transfer(x->transfer) == 0)
+		return TRUE;
+
+	pthread_mutex_lock(&usb_lock);
+	s->pending--;
+	if (!s->error)
+		s->error = EIO;
+	pthread_mutex_unlock(&usb_lock);
+	return FALSE;
+}
+
+// Set up the transfers for the pipe's endpoints on an open handle, and
+// start the IN ones.
+static usb_session* usb_session_open(libusb_device_handle *handle, int input_endpoint, int output_endpoint, BOOL bulk)
+{
+	usb_session *s = calloc(1, sizeof(*s));
+	if (!s)
+		return NULL;
+	s->handle = handle;
+
+	for (int i = 0; i < USB_OUT_TRANSFERS; i++)
 	{
-		fprintf(stderr, "libusb_submit_transfer failed\n");
-		return res;
+		usb_xfer *x = &s->out[i];
+		x->session = s;
+		x->transfer = libusb_alloc_transfer(0);
+		if (bulk)
+			libusb_fill_bulk_transfer(x->transfer, handle, output_endpoint,
+				x->data, USB_REPORT_SIZE, out_callback, x, USB_OUT_TIMEOUT_MS);
+		else
+			libusb_fill_interrupt_transfer(x->transfer, handle, output_endpoint,
+				x->data, USB_REPORT_SIZE, out_callback, x, USB_OUT_TIMEOUT_MS);
+		x->next = s->out_free;
+		s->out_free = x;
 	}
 
-	while (!bytes_transferred)
+	for (int i = 0; i < USB_IN_TRANSFERS; i++)
+	{
+		usb_xfer *x = &s->in[i];
+		x->session = s;
+		x->transfer = libusb_alloc_transfer(0);
+		if (bulk)
+			libusb_fill_bulk_transfer(x->transfer, handle, input_endpoint,
+				x->data, USB_REPORT_SIZE, in_callback, x, 0);
+		else
+			libusb_fill_interrupt_transfer(x->transfer, handle, input_endpoint,
+				x->data, USB_REPORT_SIZE, in_callback, x, 0);
+		if (!usb_submit(s, x))
+			fprintf(stderr, "libusb_submit_transfer failed\n");
+	}
+
+	return s;
+}
+
+// An interface (alternate setting) and the pair of endpoints we use on it.
+typedef struct {
+	int interface_num;
+	int alt_setting;
+	int input_endpoint;
+	int output_endpoint;
+	int input_packet_size;
+	int output_packet_size;
+} usb_pipe;
+
+// Fill in pipe with the first IN and OUT endpoint of the given transfer
+// type, if the interface has both.
+static void find_endpoints(const struct libusb_interface_descriptor *intf_desc, int type, usb_pipe* pipe)
+{
+	int input_endpoint = 0;
+	int output_endpoint = 0;
+	int input_packet_size = 0;
+	int output_packet_size = 0;
+
+	for (int l = 0; l < intf_desc->bNumEndpoints; ++l)
 	{
-		res = libusb_handle_events(context);
-		if (res)
+		const struct libusb_endpoint_descriptor* ep = &intf_desc->endpoint[l];
+		if ((ep->bmAttributes & LIBUSB_TRANSFER_TYPE_MASK) != type)
+			continue;
+
+		if ((ep->bEndpointAddress & LIBUSB_ENDPOINT_DIR_MASK) == LIBUSB_ENDPOINT_IN && !input_endpoint)
+		{
+			input_endpoint = ep->bEndpointAddress;
+			input_packet_size = ep->wMaxPacketSize;
+		}
+		if ((ep->bEndpointAddress & LIBUSB_ENDPOINT_DIR_MASK) == LIBUSB_ENDPOINT_OUT && !output_endpoint)
 		{
-			fprintf(stderr, "libusb_handle_events failed\n");
-			return res;
+			output_endpoint = ep->bEndpointAddress;
+			output_packet_size = ep->wMaxPacketSize;
 		}
 	}
-	return 0;
+
+	if (!input_endpoint || !output_endpoint)
+		return;
+
+	pipe->interface_num = intf_desc->bInterfaceNumber;
+	pipe->alt_setting = intf_desc->bAlternateSetting;
+	pipe->input_endpoint = input_endpoint;
+	pipe->output_endpoint = output_endpoint;
+	pipe->input_packet_size = input_packet_size;
+	pipe->output_packet_size = output_packet_size;
 }
 
-static libusb_context *usb_context = NULL;
-static struct libusb_transfer* read_transfer = NULL;
-static struct libusb_transfer* write_transfer = NULL;
+// What to do when usb_open_device keeps failing with EACCES.
+static void usb_access_hint(uint32_t vid, uint32_t pid)
+{
+	fprintf(stderr, "\nlibusb_open failed - are you running as 'root'?\n");
+	fprintf(stderr, "try 'sudo' or run\n");
+	fprintf(stderr, "\t$ echo 'SUBSYSTEM==\"usb\", ATTR{idVendor}==\"%04x\", ATTRS{idProduct}==\"%04x\", MODE=\"0666\", GROUP=\"plugdev\"'", vid, pid);
+	fprintf(stderr, " | sudo tee -a /etc/udev/rules.d/75-usbdl.rules\n");
+	fprintf(stderr, "\t$ sudo service udev restart\n");
+	fprintf(stderr, "and try again\n");
+}
 
-static BOOL UsbConnect3(uint32_t vid, uint32_t pid, HANDLE* UsbHandle)
+// Open a device with our VID/PID, claim the interface that we want on it
+// and set up the transfers; returns NULL if that doesn't work out, with
+// usb_last_error set to EACCES if we weren't allowed to open it.
+static usb_session* usb_open_device(libusb_device* dev)
 {
-	*UsbHandle = NULL;
+	struct libusb_config_descriptor *conf_desc = NULL;
+	if (libusb_get_active_config_descriptor(dev, &conf_desc))
+		libusb_get_config_descriptor(dev, 0, &conf_desc);
+
+	if (!conf_desc)
+		return NULL;
+
+	usb_pipe hid = { .interface_num = -1 };
+	usb_pipe bulk = { .interface_num = -1 };
+	libusb_device_handle *handle = NULL;
+	usb_session *session = NULL;
+
+	// The bootrom has a HID interface, and newer ones also have a vendor
+	// specific alternate setting with bulk endpoints; prefer the latter.
+	for (int j = 0; j < conf_desc->bNumInterfaces; j++)
+	{
+		const struct libusb_interface *intf = &conf_desc->interface[j];
+		for (int k = 0; k < intf->num_altsetting; k++)
+		{
+			const struct libusb_interface_descriptor *intf_desc = &intf->altsetting[k];
+			if (intf_desc->bInterfaceClass == LIBUSB_CLASS_HID && hid.interface_num < 0)
+				find_endpoints(intf_desc, LIBUSB_TRANSFER_TYPE_INTERRUPT, &hid);
+			if (intf_desc->bInterfaceClass == LIBUSB_CLASS_VENDOR_SPEC && bulk.interface_num < 0)
+				find_endpoints(intf_desc, LIBUSB_TRANSFER_TYPE_BULK, &bulk);
+		}
+	}
+
+	usb_pipe* pipe = bulk.interface_num >= 0 ? &bulk : &hid;
+
+	// Right after it has enumerated, udev may not have let us in yet; the
+	// caller may try again (see usb_access_hint).
+	if (pipe->interface_num >= 0)
+	{
+		int res = libusb_open(dev, &handle);
+		if (res == LIBUSB_ERROR_ACCESS)
+			usb_last_error = EACCES;
+		else if (res)
+			fprintf(stderr, "libusb_open failed\n");
+	}
+
+	if (handle && libusb_kernel_driver_active(handle, pipe->interface_num) == 1)
+	{
+		if (libusb_detach_kernel_driver(handle, pipe->interface_num))
+		{
+			libusb_close(handle);
+			handle = NULL;
+			fprintf(stderr, "libusb_detach_kernel_driver failed\n");
+		}
+	}
+
+	if (handle && libusb_claim_interface(handle, pipe->interface_num))
+	{
+		libusb_close(handle);
+		handle = NULL;
+		fprintf(stderr, "libusb_claim_interface failed\n");
+	}
+
+	if (handle && pipe == &bulk)
+	{
+		if (libusb_set_interface_alt_setting(handle, bulk.interface_num, bulk.alt_setting))
+		{
+			fprintf(stderr, "libusb_set_interface_alt_setting failed - using HID\n");
+			if (hid.interface_num == bulk.interface_num)
+			{
+				pipe = &hid;
+			}
+			else
+			{
+				libusb_close(handle);
+				handle = NULL;
+			}
+		}
+	}
+
+	if (handle)
+	{
+		static const char* speed_names[] = { "unknown", "low", "full", "high", "super" };
+		uint32_t speed = libusb_get_device_speed(dev);
+		printf("speed : %s\n", speed_names[speed > LIBUSB_SPEED_SUPER ? 0 : speed]);
+		printf("interface : %i (%s)\n", pipe->interface_num, pipe == &bulk ? "bulk" : "HID");
+		printf("input_endpoint : %02x (%i bytes)\n", pipe->input_endpoint, pipe->input_packet_size);
+		printf("output_endpoint : %02x (%i bytes)\n", pipe->output_endpoint, pipe->output_packet_size);
+
+		// A whole report is one transaction (and thus one frame) only if the
+		// endpoints are as big as the report; older bootroms use 8 bytes.
+		if (pipe->input_packet_size < USB_REPORT_SIZE || pipe->output_packet_size < USB_REPORT_SIZE)
+			printf("note : %i byte reports are split into several transactions\n", USB_REPORT_SIZE);
+
+		session = usb_session_open(handle, pipe->input_endpoint, pipe->output_endpoint, pipe == &bulk);
+		if (session)
+		{
+			session->interface_num = pipe->interface_num;
+		}
+		else
+		{
+			libusb_close(handle);
+			handle = NULL;
+		}
+	}
+
+	libusb_free_config_descriptor(conf_desc);
+
+	return session;
+}
+
+// A device's place on the bus as in /sys/bus/usb/devices: the bus, then the
+// port numbers from the root hub down, e.g. "1-1.2" for port 2 of the hub
+// on port 1 of bus 1. It stays the same as long as the cabling does.
+#define USB_PATH_MAX			32
+
+static void usb_port_path(libusb_device* dev, char* path)
+{
+	uint8_t ports[7];
+	int n = libusb_get_port_numbers(dev, ports, sizeof(ports));
+	int len = sprintf(path, "%d", libusb_get_bus_number(dev));
+
+	for (int i = 0; i < n; i++)
+		len += sprintf(path + len, "%c%d", i ? '.' : '-', ports[i]);
+}
+
+// Open up to max devices with our VID/PID; all of them if num_wanted is 0,
+// or else only those at one of the port paths in wanted[]. Returns how
+// many, with their handles in handles[] and their paths in paths[].
+static int UsbConnectPaths(uint32_t vid, uint32_t pid, char** wanted, int num_wanted, HANDLE* handles, char (*paths)[USB_PATH_MAX], int max)
+{
+	int found = 0;
 
 	if (usb_context == NULL)
 	{
 		if (libusb_init(&usb_context))
 		{
 			fprintf(stderr, "libusb_init failed\n");
-			return FALSE;
+			return 0;
 		}
 	}
 
@@ -102,187 +447,377 @@ static BOOL UsbConnect3(uint32_t vid, uint32_t pid, HANDLE* UsbHandle)
 		goto error;
 	}
 
-	for (int i = 0; i < num_devs; ++i)
+	for (int i = 0; i < num_devs && found < max; ++i)
 	{
 		libusb_device* dev = devs[i];
 		struct libusb_device_descriptor desc;
 		if (libusb_get_device_descriptor(dev, &desc))
 		{
 			fprintf(stderr, "libusb_get_device_descriptor failed\n");
+			libusb_free_device_list(devs, TRUE);
 			goto error;
 		}
 
 		if (desc.idVendor != vid || desc.idProduct != pid)
 			continue;
 
-		printf("found %04x %04x\n", desc.idVendor, desc.idProduct);
-
-		struct libusb_config_descriptor *conf_desc = NULL;
-		if (libusb_get_active_config_descriptor(dev, &conf_desc))
-			libusb_get_config_descriptor(dev, 0, &conf_desc);
+		usb_port_path(dev, paths[found]);
 
-		if (!conf_desc)
+		int j;
+		for (j = 0; j < num_wanted; j++)
+		{
+			if (strcmp(wanted[j], paths[found]) == 0)
+				break;
+		}
+		if (num_wanted && j == num_wanted)
 			continue;
 
-		int interface_num = -1;
-		int input_endpoint = 0;
-		int output_endpoint = 0;
-		libusb_device_handle *handle = NULL;
+		printf("found %04x %04x at %s\n", desc.idVendor, desc.idProduct, paths[found]);
+
+		handles[found] = usb_open_device(dev);
+
+		if (handles[found])
+			found++;
+	}
+
+	libusb_free_device_list(devs, TRUE);
+
+	return found;
 
-		for (int j = 0; j < conf_desc->bNumInterfaces; j++)
+error:
+
+	if (usb_context)
+		libusb_exit(usb_context);
+	usb_context = NULL;
+	return 0;
+}
+
+static BOOL UsbConnect3(uint32_t vid, uint32_t pid, HANDLE* UsbHandle)
+{
+	char path[1][USB_PATH_MAX];
+
+	*UsbHandle = NULL;
+	return UsbConnectPaths(vid, pid, NULL, 0, UsbHandle, path, 1) == 1;
+}
+
+void Sleep(DWORD dwMilliseconds)
+{
+	usleep(dwMilliseconds * 1000);
+}
+
+DWORD GetTickCount(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint32_t)ts.tv_sec * 1000u + ts.tv_nsec / 1000000;
+}
+
+
+// Devices that the hotplug callback reported, for UsbWaitConnect3 to open
+// once libusb is out of the callback (it doesn't want us to do that in
+// there), and how often opening them failed so far. The callback runs in
+// whichever thread handles libusb's events, so usb_lock guards them.
+#define USB_MAX_ARRIVED			16
+#define USB_OPEN_RETRIES		100
+#define USB_OPEN_RETRY_MS		10
+
+static libusb_device* usb_arrived[USB_MAX_ARRIVED];
+static int usb_arrived_tries[USB_MAX_ARRIVED];
+static int usb_num_arrived = 0;
+
+// Without hotplug support, how often UsbWaitConnect3 scans the bus.
+#define USB_SCAN_INTERVAL_MS	250
+
+static int hotplug_callback(libusb_context *ctx, libusb_device *dev, libusb_hotplug_event event, void *user_data)
+{
+	pthread_mutex_lock(&usb_lock);
+	if (usb_num_arrived < USB_MAX_ARRIVED)
+	{
+		usb_arrived_tries[usb_num_arrived] = 0;
+		usb_arrived[usb_num_arrived++] = libusb_ref_device(dev);
+	}
+	pthread_mutex_unlock(&usb_lock);
+	return 0;
+}
+
+// Wait up to timeout_ms (for good if it's negative) for devices with our
+// VID/PID, and open them as UsbConnectPaths does: up to max of them, at one
+// of the port paths in wanted[] unless num_wanted is 0. Returns how many,
+// as soon as all of wanted[] (or max) are open or the time is up; with
+// num_wanted 0, the time starts over whenever one more opens, so that
+// devices that are still enumerating get their chance. With hotplug
+// support libusb tells us as soon as a device has enumerated, and we sleep
+// in libusb until then; without, we scan the bus every USB_SCAN_INTERVAL_MS.
+static int UsbWaitConnectPaths(uint32_t vid, uint32_t pid, char** wanted, int num_wanted, HANDLE* handles, char (*paths)[USB_PATH_MAX], int max, int timeout_ms)
+{
+	libusb_hotplug_callback_handle callback;
+	struct timespec start, now;
+	BOOL hotplug;
+	int found = 0;
+
+	if (num_wanted && num_wanted < max)
+		max = num_wanted;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	if (usb_context == NULL)
+	{
+		if (libusb_init(&usb_context))
 		{
-			const struct libusb_interface *intf = &conf_desc->interface[j];
-			for (int k = 0; k < intf->num_altsetting; k++)
-			{
-				const struct libusb_interface_descriptor *intf_desc = &intf->altsetting[k];
-				if (intf_desc->bInterfaceClass == LIBUSB_CLASS_HID)
-				{
-					interface_num = intf_desc->bInterfaceNumber;
-					for (int l = 0; l < intf_desc->bNumEndpoints; ++l)
-					{
-						const struct libusb_endpoint_descriptor* ep = &intf_desc->endpoint[l];
-						if ((ep->bmAttributes & LIBUSB_TRANSFER_TYPE_MASK) != LIBUSB_TRANSFER_TYPE_INTERRUPT)
-							continue;
-
-						if ((ep->bEndpointAddress & LIBUSB_ENDPOINT_DIR_MASK) == LIBUSB_ENDPOINT_IN)
-							input_endpoint = input_endpoint ? input_endpoint : ep->bEndpointAddress;
-						if ((ep->bEndpointAddress & LIBUSB_ENDPOINT_DIR_MASK) == LIBUSB_ENDPOINT_OUT)
-							output_endpoint = output_endpoint ? output_endpoint : ep->bEndpointAddress;
-					}
-					goto interface_found;
-				}
-			}
+			fprintf(stderr, "libusb_init failed\n");
+			return 0;
 		}
+	}
 
-interface_found:
-		printf("interface : %i\n", interface_num);
-		printf("input_endpoint : %02x\n", input_endpoint);
-		printf("output_endpoint : %02x\n", output_endpoint);
+	// LIBUSB_HOTPLUG_ENUMERATE reports the devices that are already there,
+	// too, so there's no need to scan first.
+	hotplug = libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG) &&
+		libusb_hotplug_register_callback(usb_context,
+			LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED, LIBUSB_HOTPLUG_ENUMERATE,
+			vid, pid, LIBUSB_HOTPLUG_MATCH_ANY, hotplug_callback, NULL,
+			&callback) == 0;
 
-		static const char* speed_names[] = { "unknown", "low", "full", "high", "super" };
-		uint32_t speed = libusb_get_device_speed(dev);
-		printf("speed : %s\n", speed_names[speed > LIBUSB_SPEED_SUPER ? 0 : speed]);
+	while (found < max)
+	{
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		long left = timeout_ms - ((now.tv_sec - start.tv_sec) * 1000 +
+			(now.tv_nsec - start.tv_nsec) / 1000000);
+		if (timeout_ms < 0)
+			left = 60 * 1000;
+		else if (left <= 0)
+			break;
 
-		if (interface_num >= 0)
+		if (!hotplug)
 		{
-			int res = libusb_open(dev, &handle);
-			if (res == LIBUSB_ERROR_ACCESS)
+			// only those that we don't have yet; with num_wanted 0, one scan
+			// that finds any finds all there are
+			if (num_wanted == 0 && found > 0)
+				break;
+			char* missing[max];
+			int num_missing = 0;
+			for (int i = 0; i < num_wanted; i++)
 			{
-				fprintf(stderr, "\nlibusb_open failed - are you running as 'root'?\n");
-				fprintf(stderr, "try 'sudo' or run\n");
-				fprintf(stderr, "\t$ echo 'SUBSYSTEM==\"usb\", ATTR{idVendor}==\"%04x\", ATTRS{idProduct}==\"%04x\", MODE=\"0666\", GROUP=\"plugdev\"'", desc.idVendor, desc.idProduct);
-				fprintf(stderr, " | sudo tee -a /etc/udev/rules.d/75-usbdl.rules\n");
-				fprintf(stderr, "\t$ sudo service udev restart\n");
-				fprintf(stderr, "and try again\n");
-				exit(-1);
+				int j;
+				for (j = 0; j < found && strcmp(wanted[i], paths[j]); j++)
+					;
+				if (j == found)
+					missing[num_missing++] = wanted[i];
 			}
-			if (res)
-				fprintf(stderr, "libusb_open failed\n");
+			found += UsbConnectPaths(vid, pid, missing, num_missing,
+				handles + found, paths + found, max - found);
+			if (found < max)
+				Sleep(left < USB_SCAN_INTERVAL_MS ? left : USB_SCAN_INTERVAL_MS);
+			continue;
 		}
 
-		if (handle && libusb_kernel_driver_active(handle, interface_num) == 1)
+		pthread_mutex_lock(&usb_lock);
+		int n = usb_num_arrived - 1;
+		libusb_device *dev = n >= 0 ? usb_arrived[n] : NULL;
+		int tries = n >= 0 ? usb_arrived_tries[n] : 0;
+		pthread_mutex_unlock(&usb_lock);
+
+		if (!dev)
 		{
-			if (libusb_detach_kernel_driver(handle, interface_num))
-			{
-				libusb_close(handle);
-				handle = NULL;
-				fprintf(stderr, "libusb_detach_kernel_driver failed\n");
-			}
+			struct timeval tv = { left / 1000, (left % 1000) * 1000 };
+			libusb_handle_events_timeout_completed(usb_context, &tv, NULL);
+			continue;
 		}
 
-		if (handle && libusb_claim_interface(handle, interface_num))
+		// Not one that we want, or one that we have already.
+		usb_port_path(dev, paths[found]);
+		int j;
+		for (j = 0; j < num_wanted && strcmp(wanted[j], paths[found]); j++)
+			;
+		BOOL skip = num_wanted && j == num_wanted;
+		for (j = 0; j < found && !skip; j++)
+			skip = strcmp(paths[j], paths[found]) == 0;
+
+		// The newest first; a device that just arrived may not let us in
+		// yet (udev still setting it up), so it gets a few more tries.
+		struct libusb_device_descriptor desc;
+		handles[found] = NULL;
+		usb_last_error = 0;
+		if (!skip && libusb_get_device_descriptor(dev, &desc) == 0)
 		{
-			libusb_close(handle);
-			handle = NULL;
-			fprintf(stderr, "libusb_claim_interface failed\n");
+			if (tries == 0)
+				printf("found %04x %04x at %s\n", desc.idVendor, desc.idProduct, paths[found]);
+			handles[found] = usb_open_device(dev);
 		}
-
-		if (handle)
+		if (!skip && !handles[found] && ++tries < USB_OPEN_RETRIES)
 		{
-			int timeout = 100;
-			read_transfer = libusb_alloc_transfer(0);
-			libusb_fill_interrupt_transfer(	read_transfer,
-											handle,
-											input_endpoint,
-											buffer,
-											sizeof(buffer),
-											transfer_callback,
-											0,
-											timeout);
-
-			write_transfer = libusb_alloc_transfer(0);
-			libusb_fill_interrupt_transfer( write_transfer,
-											handle,
-											output_endpoint,
-											buffer,
-											sizeof(buffer),
-											transfer_callback,
-											0,
-											timeout);
+			pthread_mutex_lock(&usb_lock);
+			usb_arrived_tries[n] = tries;
+			pthread_mutex_unlock(&usb_lock);
+			Sleep(USB_OPEN_RETRY_MS);
+			continue;
+		}
+		if (!skip && !handles[found] && usb_last_error == EACCES)
+			usb_access_hint(vid, pid);
+		if (handles[found])
+		{
+			found++;
+			if (num_wanted == 0)
+				clock_gettime(CLOCK_MONOTONIC, &start);
 		}
 
-		*UsbHandle = handle;
-
-		libusb_free_config_descriptor(conf_desc);
-
-		if (*UsbHandle)
-			break;
+		// the callback only ever adds at the end, so n is still ours
+		pthread_mutex_lock(&usb_lock);
+		usb_num_arrived--;
+		usb_arrived[n] = usb_arrived[usb_num_arrived];
+		usb_arrived_tries[n] = usb_arrived_tries[usb_num_arrived];
+		pthread_mutex_unlock(&usb_lock);
+		libusb_unref_device(dev);
 	}
 
-	libusb_free_device_list(devs, TRUE);
-
-	return (*UsbHandle != NULL);
-
-error:
+	if (hotplug)
+	{
+		libusb_hotplug_deregister_callback(usb_context, callback);
+		pthread_mutex_lock(&usb_lock);
+		while (usb_num_arrived > 0)
+			libusb_unref_device(usb_arrived[--usb_num_arrived]);
+		pthread_mutex_unlock(&usb_lock);
+	}
 
-	if (usb_context)
-		libusb_exit(usb_context);
-	usb_context = NULL;
-	return FALSE;
+	return found;
 }
 
-void Sleep(DWORD dwMilliseconds)
+// Wait up to timeout_ms (for good if it's negative) for a device with our
+// VID/PID, and open it.
+static BOOL UsbWaitConnect3(uint32_t vid, uint32_t pid, HANDLE* UsbHandle, int timeout_ms)
 {
-	usleep(dwMilliseconds * 1000);
-}
+	char path[1][USB_PATH_MAX];
 
+	*UsbHandle = NULL;
+	return UsbWaitConnectPaths(vid, pid, NULL, 0, UsbHandle, path, 1, timeout_ms) == 1;
+}
 
+// Wait for the device's next report, and hand it over as if it came from
+// a HID report with ID 0.
 BOOL ReadFile(HANDLE hFile, LPVOID lpBuffer, DWORD nNumberOfBytesToRead, DWORD* lpNumberOfBytesRead, LPOVERLAPPED lpOverlapped )
 {
-	if (submit_transfer(usb_context, read_transfer))
+	usb_session *s = hFile;
+
+	if (!usb_wait(s, &s->in_head, USB_IN_TIMEOUT_MS))
 		return FALSE;
 
-	size_t bytes_to_copy = nNumberOfBytesToRead < bytes_transferred ? nNumberOfBytesToRead : bytes_transferred;
-	memcpy(lpBuffer+1, buffer, bytes_to_copy);
+	usb_xfer *x = s->in_head;
+	s->in_head = x->next;
+	if (!s->in_head)
+		s->in_tail = NULL;
+	pthread_mutex_unlock(&usb_lock);
+
+	size_t bytes_to_copy = x->transfer->actual_length;
+	if (bytes_to_copy > (size_t)(nNumberOfBytesToRead - 1))
+		bytes_to_copy = nNumberOfBytesToRead - 1;
+	memcpy((char*)lpBuffer+1, x->data, bytes_to_copy);
 	((char*)lpBuffer)[0] = 0;
 
 	if (lpNumberOfBytesRead)
 		*lpNumberOfBytesRead = bytes_to_copy+1;
 
-	bytes_transferred = 0;
+	// and it goes straight back into the queue for the next report
+	usb_submit(s, x);
+
 	fflush(stdout);
 	return TRUE;
 }
 
+// Queue a report (after its ID byte) for the device, and return without
+// waiting for it to go out; only when all the OUT transfers are on their
+// way do we wait for one to come back. A transfer that fails makes the next
+// call (or GetOverlappedResult) fail.
 BOOL WriteFile(HANDLE hFile, const LPVOID lpBuffer, DWORD nNumberOfBytesToWrite, DWORD* lpNumberOfBytesWritten, LPOVERLAPPED lpOverlapped)
 {
-	nNumberOfBytesToWrite--;
+	usb_session *s = hFile;
+
+	if (!usb_wait(s, &s->out_free, USB_OUT_TIMEOUT_MS))
+		return FALSE;
+
+	usb_xfer *x = s->out_free;
+	s->out_free = x->next;
+	pthread_mutex_unlock(&usb_lock);
 
-	size_t bytes_to_copy = nNumberOfBytesToWrite < sizeof(buffer) ? nNumberOfBytesToWrite : sizeof(buffer);
-	memcpy(buffer, lpBuffer+1, bytes_to_copy);
+	size_t bytes_to_copy = nNumberOfBytesToWrite - 1;
+	if (bytes_to_copy > USB_REPORT_SIZE)
+		bytes_to_copy = USB_REPORT_SIZE;
+	memset(x->data, 0, USB_REPORT_SIZE);
+	memcpy(x->data, (const char*)lpBuffer+1, bytes_to_copy);
 
-	if (submit_transfer(usb_context, write_transfer))
+	if (!usb_submit(s, x))
+	{
+		pthread_mutex_lock(&usb_lock);
+		x->next = s->out_free;
+		s->out_free = x;
+		pthread_mutex_unlock(&usb_lock);
+		usb_last_error = EIO;
 		return FALSE;
+	}
 
 	if (lpNumberOfBytesWritten)
-		*lpNumberOfBytesWritten = bytes_transferred+1;
+		*lpNumberOfBytesWritten = bytes_to_copy+1;
+	usb_last_error = ERROR_IO_PENDING;
+	return TRUE;
+}
 
-	bytes_transferred = 0;
-	fflush(stdout);
+// Done with the device: cancel the transfers that are still on the way, let
+// libusb call them back, and then give back the transfers, the interface
+// and the handle. If a transfer doesn't come back within USB_OUT_TIMEOUT_MS
+// everything stays allocated, as libusb may still use it.
+BOOL CloseHandle(HANDLE hObject)
+{
+	usb_session *s = hObject;
+	struct timespec start, now;
+
+	if (!s)
+		return FALSE;
+
+	for (int i = 0; i < USB_OUT_TRANSFERS; i++)
+		libusb_cancel_transfer(s->out[i].transfer);
+	for (int i = 0; i < USB_IN_TRANSFERS; i++)
+		libusb_cancel_transfer(s->in[i].transfer);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	pthread_mutex_lock(&usb_lock);
+	while (s->pending)
+	{
+		s->completed = 0;
+		pthread_mutex_unlock(&usb_lock);
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		long left = USB_OUT_TIMEOUT_MS - ((now.tv_sec - start.tv_sec) * 1000 +
+			(now.tv_nsec - start.tv_nsec) / 1000000);
+		if (left <= 0)
+		{
+			fprintf(stderr, "libusb_cancel_transfer timed out\n");
+			usb_last_error = ETIMEDOUT;
+			return FALSE;
+		}
+
+		struct timeval tv = { left / 1000, (left % 1000) * 1000 };
+		libusb_handle_events_timeout_completed(usb_context, &tv, &s->completed);
+		pthread_mutex_lock(&usb_lock);
+	}
+	pthread_mutex_unlock(&usb_lock);
+
+	for (int i = 0; i < USB_OUT_TRANSFERS; i++)
+		libusb_free_transfer(s->out[i].transfer);
+	for (int i = 0; i < USB_IN_TRANSFERS; i++)
+		libusb_free_transfer(s->in[i].transfer);
+
+	libusb_release_interface(s->handle, s->interface_num);
+	libusb_close(s->handle);
+	free(s);
 	return TRUE;
 }
 
 BOOL GetOverlappedResult(HANDLE hFile, LPOVERLAPPED lpOverlapped, DWORD* lpNumberOfBytesTransferred, BOOL bWait) {
+	usb_session *s = hFile;
+	pthread_mutex_lock(&usb_lock);
+	int error = s->error;
+	pthread_mutex_unlock(&usb_lock);
+	if (error) {
+		usb_last_error = error;
+		return FALSE;
+	}
 	return TRUE;
 }
 
@@ -297,5 +832,5 @@ DWORD FormatMessage(DWORD dwFlags, const LPVOID lpSource, DWORD dwMessageId, DWO
 }
 
 DWORD GetLastError(void) {
-	return ERROR_IO_PENDING;
+	return usb_last_error;
 }
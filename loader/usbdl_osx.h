@@ -3,6 +3,7 @@
 #include <IOKit/hid/IOHIDManager.h>
 #include <IOKit/hid/IOHIDKeys.h>
 #include <CoreFoundation/CoreFoundation.h>
+#include <sys/time.h>
 
 typedef unsigned char BYTE;
 typedef unsigned int DWORD;
@@ -102,6 +103,13 @@ void Sleep(DWORD dwMilliseconds)
 	usleep(dwMilliseconds * 1000);
 }
 
+DWORD GetTickCount(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
 BOOL ReadFile(HANDLE hFile, LPVOID lpBuffer, DWORD nNumberOfBytesToRead, DWORD* lpNumberOfBytesRead, LPOVERLAPPED lpOverlapped )
 {
 	while (!bytes_available)